@@ -148,6 +148,17 @@
  */
 #define SPARSE_PAGE_SIZE (1 << 10)
 
+/*
+ * Emulated address of the first region mem_map hands out, past the end of
+ * the largest possible heap
+ */
+#define SPARSE_REGION_START (void *)0x6130051300000000UL
+
+/*
+ * Address space given to each emulated region, the most it can grow to
+ */
+#define SPARSE_REGION_SLOT (1UL << 36)
+
 /*
  * Maximum target load for hash table
  */
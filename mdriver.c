@@ -16,6 +16,7 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -50,6 +51,7 @@
 
 /***************** Misc *********/
 #define MAXLINE 1024 /* max string size */
+#define PARALLEL_RUNS 3 /* runs of each trace for -P, fastest one counts */
 
 /******************************
  * The key compound data types
@@ -83,6 +85,18 @@ typedef struct {
     tree_t *lo_tree;
 } range_set_t;
 
+/*
+ * Holds the params of one thread of eval_mm_parallel.  Every thread
+ * replays the same trace with its own array of block pointers.
+ */
+typedef struct {
+    const trace_t *trace;
+    char **blocks;              /* this thread's copy of trace->blocks */
+    pthread_barrier_t *barrier; /* released when all threads are ready */
+    bool ok;                    /* did every request succeed? */
+    double start, end;          /* when this thread started and finished */
+} parallel_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -93,6 +107,15 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+/*
+ * Holds the params to eval_mm_batch_speed, which is timed by fcyc.  ptrs
+ * has room for one pointer per trace operation.
+ */
+typedef struct {
+    trace_t *trace;
+    void **ptrs;
+} batch_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set from the trace parameters */
@@ -107,6 +130,22 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    size_t sbrks; /* mem_sbrk calls while measuring util */
+    size_t peak;  /* peak heap size while measuring util */
+    double par_tput; /* total Kops/s with -P threads at once (0 if failed) */
+    double par_speedup; /* par_tput over the same replay on one thread */
+    double eager_util;  /* util with coalescing on every free (-L) */
+    double eager_tput;  /* Kops/s with coalescing on every free (-L) */
+    double defer_util;  /* util with coalescing deferred (-L) */
+    double defer_tput;  /* Kops/s with coalescing deferred (-L) */
+    double batch_util;  /* util with runs of requests batched (-B) */
+    double batch_tput;  /* Kops/s with runs of requests batched (-B) */
+    size_t slack_blocks; /* blocks allocated while measuring util */
+    double slack_avg;    /* mean usable bytes past the request (-U) */
+    double slack_frac;   /* share of the usable bytes that is slack (-U) */
+    struct mm_stats counters; /* mm_stats at the end of the util run (-M) */
+    struct mm_stats peak_counters; /* mm_stats at its peak of live bytes */
+    size_t alloc_bytes;  /* bytes asked for while measuring util */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -145,6 +184,36 @@ static unsigned int verbose = REF_ONLY ? 0 : 1; /* verbosity level */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+/* Reallocs of a live block seen by eval_mm_util, by whether it moved */
+static unsigned long reallocs_in_place = 0;
+static unsigned long reallocs_copied = 0;
+/* Blocks allocated by eval_mm_util, with the bytes asked for and usable */
+static size_t slack_blocks = 0;
+static size_t slack_requested = 0;
+static size_t slack_usable = 0;
+/* mm_stats at the end and at the peak of the last eval_mm_util (-M) */
+static struct mm_stats util_counters;
+static struct mm_stats util_peak_counters;
+/* Threads replaying each trace at once for the scaling test (-P) */
+static unsigned int num_threads = 1;
+/* Also run each trace with eager and with deferred coalescing (-L) */
+static bool defer_report = false;
+/* Also run each trace with runs of mallocs and frees batched (-B) */
+static bool batch_report = false;
+/* Free each block with the size it was requested with (-F) */
+static bool sized_free = false;
+/* Also report the mem_sbrk calls of each trace (-S) */
+static bool sbrk_report = false;
+/* Also report the usable bytes past each request of each trace (-U) */
+static bool slack_report = false;
+/* Also report the allocator's own counters for each trace (-M) */
+static bool counters_report = false;
+/* Mean bytes between samples of the heap profile, 0 for none (-H) */
+static size_t profile_rate = 0;
+/* Ops between samples of the fragmentation CSV, 0 for none (-K) */
+static unsigned int frag_interval = 0;
+/* Where eval_mm_util writes the fragmentation samples of the trace */
+static FILE *frag_file = NULL;
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -202,10 +271,26 @@ static void eval_libc_speed(void *ptr);
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, size_t tracenum);
 static void eval_mm_speed(void *ptr);
+static FILE *open_frag_csv(const char *tracefile);
+static void write_frag_sample(FILE *csv, unsigned int opnum,
+                              size_t live_bytes);
+static char *alloc_op(const traceop_t *op);
+static void free_op(char *p, size_t size);
+static double eval_mm_parallel(trace_t *trace, unsigned int nthreads);
 static double compute_scaled_score(double value, double min, double max);
 
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
+static void print_parallel_results(size_t n, stats_t *stats);
+static void print_defer_results(size_t n, stats_t *stats);
+static void print_sbrk_results(size_t n, stats_t *stats);
+static void print_slack_results(size_t n, stats_t *stats);
+static void print_counters_results(size_t n, stats_t *stats);
+static void print_profile_results(size_t n, stats_t *stats);
+static void print_batch_results(size_t n, stats_t *stats);
+static void eval_mm_defer(trace_t *trace, size_t tracenum, stats_t *stats,
+                          speed_t *speed_params);
+static void eval_mm_batch(trace_t *trace, stats_t *stats);
 static void usage(const char *prog);
 static void malloc_error(const trace_t *trace, unsigned int opnum,
                          const char *fmt, ...)
@@ -286,7 +371,27 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 fputs(", efficiency", stderr);
                 fflush(stderr);
             }
+            if (frag_interval > 0)
+                frag_file = open_frag_csv(tracefiles[i]);
             mm_stats[i].util = eval_mm_util(trace, i);
+            if (frag_file != NULL) {
+                fclose(frag_file);
+                frag_file = NULL;
+            }
+            mm_stats[i].sbrks = mem_sbrk_calls();
+            mm_stats[i].peak = mem_heapsize_peak();
+            mm_stats[i].slack_blocks = slack_blocks;
+            if (slack_blocks > 0) {
+                mm_stats[i].slack_avg =
+                    (double)(slack_usable - slack_requested) /
+                    (double)slack_blocks;
+                mm_stats[i].slack_frac =
+                    (double)(slack_usable - slack_requested) /
+                    (double)slack_usable;
+            }
+            mm_stats[i].counters = util_counters;
+            mm_stats[i].peak_counters = util_peak_counters;
+            mm_stats[i].alloc_bytes = slack_requested;
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1) {
@@ -296,6 +401,31 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (num_threads > 1 && !sparse_mode) {
+                if (verbose > 1) {
+                    fprintf(stderr, ", and scaling on %u threads",
+                            num_threads);
+                    fflush(stderr);
+                }
+                double single = eval_mm_parallel(trace, 1);
+                mm_stats[i].par_tput = eval_mm_parallel(trace, num_threads);
+                mm_stats[i].par_speedup =
+                    single > 0 ? mm_stats[i].par_tput / single : 0;
+            }
+            if (defer_report) {
+                if (verbose > 1) {
+                    fputs(", and with eager and deferred coalescing", stderr);
+                    fflush(stderr);
+                }
+                eval_mm_defer(trace, i, &mm_stats[i], speed_params);
+            }
+            if (batch_report) {
+                if (verbose > 1) {
+                    fputs(", and with requests batched", stderr);
+                    fflush(stderr);
+                }
+                eval_mm_batch(trace, &mm_stats[i]);
+            }
         }
 #endif
         if (verbose > 0) {
@@ -350,7 +480,8 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlBDFLMSTUH:K:P:")) !=
+           EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -415,6 +546,55 @@ int main(int argc, char **argv) {
             tab_mode = true;
             break;
 
+        case 'L': /* Also compare eager and deferred coalescing */
+            defer_report = true;
+            break;
+
+        case 'B': /* Also compare single and batched requests */
+            batch_report = true;
+            break;
+
+        case 'F': /* Free with the size of each block */
+            sized_free = true;
+            break;
+
+        case 'S': /* Also report the mem_sbrk calls of each trace */
+            sbrk_report = true;
+            break;
+
+        case 'U': /* Also report the slack of the blocks of each trace */
+            slack_report = true;
+            break;
+
+        case 'M': /* Also report the counters of mm_stats for each trace */
+            counters_report = true;
+            break;
+
+        case 'H': /* Sample allocations for the heap profile */
+            profile_rate = atoui_or_usage(optarg, "-H", argv[0]);
+            if (!mm_profile_start(profile_rate))
+                app_error("mm_profile_start failed");
+            break;
+
+        case 'K': /* Write the free blocks every <k> ops to a CSV file */
+            frag_interval = atoui_or_usage(optarg, "-K", argv[0]);
+            if (frag_interval == 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'P': /* Also replay each trace on several threads at once */
+            num_threads = atoui_or_usage(optarg, "-P", argv[0]);
+            if (num_threads == 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            if (num_threads > 1 && !mm_thread_safe())
+                app_error("-P %u needs the thread-safe allocator of mdriver-mt",
+                          num_threads);
+            break;
+
         case 'h': /* Print usage message */
             usage(argv[0]);
             exit(0);
@@ -548,6 +728,44 @@ int main(int argc, char **argv) {
         } else {
             puts("\nResults for mm malloc:");
             printresults(num_tracefiles, mm_stats, &mm_sum_stats);
+            if (reallocs_in_place + reallocs_copied > 0) {
+                printf("Reallocs: %lu in place, %lu copied (%.1f%% in "
+                       "place).\n",
+                       reallocs_in_place, reallocs_copied,
+                       100.0 * (double)reallocs_in_place /
+                           (double)(reallocs_in_place + reallocs_copied));
+            }
+            if (num_threads > 1 && !sparse_mode) {
+                printf("\nScaling of mm malloc on %u threads:\n", num_threads);
+                print_parallel_results(num_tracefiles, mm_stats);
+            }
+            if (sbrk_report) {
+                puts("\nHeap growth of mm malloc:");
+                print_sbrk_results(num_tracefiles, mm_stats);
+            }
+            if (slack_report) {
+                puts("\nUsable bytes of mm malloc past each request:");
+                print_slack_results(num_tracefiles, mm_stats);
+            }
+            if (counters_report) {
+                puts("\nCounters of mm malloc (mm_stats):");
+                print_counters_results(num_tracefiles, mm_stats);
+            }
+            if (profile_rate != 0) {
+                printf("\nHeap profile of mm malloc, one sample per %zu "
+                       "bytes:\n",
+                       profile_rate);
+                print_profile_results(num_tracefiles, mm_stats);
+            }
+            if (defer_report) {
+                puts("\nCoalescing of mm malloc, eager vs. deferred:");
+                print_defer_results(num_tracefiles, mm_stats);
+            }
+            if (batch_report) {
+                puts("\nRuns of mallocs and frees of mm malloc, one call "
+                     "each vs. batched:");
+                print_batch_results(num_tracefiles, mm_stats);
+            }
         }
     }
 
@@ -741,10 +959,19 @@ static range_set_t *new_range_set(void) {
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, unsigned int opnum,
                       unsigned int index) {
-    char *hi = lo + size - 1;
-
     assert(size > 0);
 
+    /* The caller may use every byte mm_malloc_usable_size reports, so those
+       are the ones that must not overlap another payload */
+    size_t usable = mm_malloc_usable_size(lo);
+    if (usable < size) {
+        malloc_error(trace, opnum,
+                     "Usable size of payload (%p) is %zu bytes, not %zu",
+                     (void *)lo, usable, size);
+        return false;
+    }
+    char *hi = lo + usable - 1;
+
     /* Payload addresses must be ALIGNMENT-byte aligned */
     if (!IS_ALIGNED(lo)) {
         malloc_error(trace, opnum,
@@ -753,9 +980,20 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* and memalign payloads to the alignment asked for */
+    size_t align = trace->ops[opnum].align;
+    if (align > 0 && ((unsigned long)lo & (align - 1)) != 0) {
+        malloc_error(trace, opnum,
+                     "Payload address (%p) not aligned to %zu bytes",
+                     (void *)lo, align);
+        return false;
+    }
+
+    /* The payload must lie within the extent of the heap, or within one
+       region the allocator mapped outside of it */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi)) {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      (void *)lo, (void *)hi, (void *)mem_heap_lo(),
                      (void *)mem_heap_hi());
@@ -990,10 +1228,11 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
 
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_malloc */
+        case ALLOC:    /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = alloc_op(&trace->ops[i])) == NULL) {
                 malloc_error(trace, i, "mm_malloc failed");
                 return false;
             }
@@ -1070,11 +1309,13 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             /* Remove region from list and call student's free function */
             if (index == (unsigned int)-1) {
                 p = 0;
+                size = 0;
             } else {
                 p = trace->blocks[index];
+                size = trace->block_sizes[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            free_op(p, size);
             break;
 
         default:
@@ -1085,15 +1326,45 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     return allCheck;
 }
 
+/*
+ * eval_mm_defer - Measure the utilization and throughput of a trace once
+ *   with coalescing on every free and once with coalescing deferred, then
+ *   restore the package's own choice.  The realloc counts only reflect the
+ *   package's own choice.
+ */
+static void eval_mm_defer(trace_t *trace, size_t tracenum, stats_t *stats,
+                          speed_t *speed_params) {
+    unsigned long in_place = reallocs_in_place;
+    unsigned long copied = reallocs_copied;
+    bool deferred = mm_defer_coalescing(false);
+
+    stats->eager_util = eval_mm_util(trace, tracenum);
+    if (!sparse_mode) {
+        stats->eager_tput =
+            stats->ops / (fsec(eval_mm_speed, speed_params) * 1000.0);
+    }
+
+    mm_defer_coalescing(true);
+    stats->defer_util = eval_mm_util(trace, tracenum);
+    if (!sparse_mode) {
+        stats->defer_tput =
+            stats->ops / (fsec(eval_mm_speed, speed_params) * 1000.0);
+    }
+
+    mm_defer_coalescing(deferred);
+    reallocs_in_place = in_place;
+    reallocs_copied = copied;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size the heap reached while running the student's malloc
+ *   package on the trace. mem_sbrk() lets the package give memory back,
+ *   which is why the peak and not the final break counts. Regions from
+ *   mem_map() count towards heapsize for as long as they are mapped.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1107,6 +1378,7 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     char *newp, *oldp;
 
     reinit_trace(trace);
+    slack_blocks = slack_requested = slack_usable = 0;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
@@ -1116,11 +1388,12 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     for (i = 0; i < trace->num_ops; i++) {
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_alloc */
+        case ALLOC:    /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = alloc_op(&trace->ops[i])) == NULL) {
                 app_error("trace %zd: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1129,6 +1402,10 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             trace->blocks[index] = p;
             trace->block_sizes[index] = size;
 
+            slack_blocks++;
+            slack_requested += size;
+            slack_usable += mm_malloc_usable_size(p);
+
             total_size += size;
             break;
 
@@ -1145,10 +1422,24 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             }
             setUBCheck(true);
 
+            /* Count whether the block could be resized where it was */
+            if (oldp != NULL && newsize != 0) {
+                if (newp == oldp)
+                    reallocs_in_place++;
+                else
+                    reallocs_copied++;
+            }
+
             /* Remember region and size */
             trace->blocks[index] = newp;
             trace->block_sizes[index] = newsize;
 
+            if (newp != NULL) {
+                slack_blocks++;
+                slack_requested += newsize;
+                slack_usable += mm_malloc_usable_size(newp);
+            }
+
             total_size += (newsize - oldsize);
             break;
 
@@ -1162,7 +1453,7 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            free_op(p, size);
 
             total_size -= size;
             break;
@@ -1173,11 +1464,79 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
         }
 
         /* update the high-water mark */
-        max_total_size =
-            (total_size > max_total_size) ? total_size : max_total_size;
+        if (total_size > max_total_size) {
+            max_total_size = total_size;
+            if (counters_report || profile_rate != 0)
+                mm_stats(&util_peak_counters);
+        }
+
+        if (frag_file != NULL && (i + 1) % frag_interval == 0)
+            write_frag_sample(frag_file, i + 1, total_size);
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    if (frag_file != NULL && trace->num_ops % frag_interval != 0)
+        write_frag_sample(frag_file, trace->num_ops, total_size);
+
+    if (counters_report || profile_rate != 0)
+        mm_stats(&util_counters);
+
+    return ((double)max_total_size / (double)mem_heapsize_peak());
+}
+
+/*
+ * open_frag_csv - Create <trace>.frag.csv in the current directory, named
+ *   after the trace file without its directory and .rep suffix, and write
+ *   the header row of the samples eval_mm_util will add to it.
+ */
+static FILE *open_frag_csv(const char *tracefile) {
+    const char *base = strrchr(tracefile, '/');
+    base = base != NULL ? base + 1 : tracefile;
+    size_t len = strlen(base);
+    if (len > 4 && strcmp(base + len - 4, ".rep") == 0)
+        len -= 4;
+
+    char path[MAXLINE];
+    snprintf(path, sizeof(path), "%.*s.frag.csv", (int)len, base);
+    FILE *csv = fopen(path, "w");
+    if (csv == NULL)
+        unix_error("Could not open %s", path);
+
+    /* The bucket layout is fixed, so the counters give it without a walk */
+    struct mm_stats stats;
+    mm_stats(&stats);
+    fprintf(csv, "op,live_bytes,heap_bytes,mapped_bytes,in_use_bytes,"
+                 "internal_bytes,external_bytes,free_bytes,deferred_bytes,"
+                 "slab_free_bytes,largest_free,mini_blocks");
+    for (size_t b = 0; b < stats.buckets; b++)
+        fprintf(csv, ",blocks_%zu,bytes_%zu", stats.bucket_min_size[b],
+                stats.bucket_min_size[b]);
+    fputc('\n', csv);
+    return csv;
+}
+
+/*
+ * write_frag_sample - Walk the heap after op <opnum> and add a row to the
+ *   fragmentation CSV. Internal bytes are those of allocated blocks beyond
+ *   what the trace asked for (headers, padding, rounding); external bytes
+ *   are those of free blocks, deferred frees and free slab objects.
+ */
+static void write_frag_sample(FILE *csv, unsigned int opnum,
+                              size_t live_bytes) {
+    struct mm_frag frag;
+    mm_heap_frag(&frag);
+    size_t internal =
+        frag.in_use_bytes > live_bytes ? frag.in_use_bytes - live_bytes : 0;
+    size_t external =
+        frag.free_bytes + frag.deferred_bytes + frag.slab_free_bytes;
+
+    fprintf(csv, "%u,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu", opnum,
+            live_bytes, frag.heap_bytes, frag.mapped_bytes, frag.in_use_bytes,
+            internal, external, frag.free_bytes, frag.deferred_bytes,
+            frag.slab_free_bytes, frag.largest_free, frag.mini_free_blocks);
+    for (size_t b = 0; b < frag.buckets; b++)
+        fprintf(csv, ",%zu,%zu", frag.bucket_free_blocks[b],
+                frag.bucket_free_bytes[b]);
+    fputc('\n', csv);
 }
 
 /*
@@ -1200,12 +1559,16 @@ static void eval_mm_speed(void *ptr) {
     for (i = 0; i < trace->num_ops; i++)
         switch (trace->ops[i].type) {
 
-        case ALLOC: /* mm_malloc */
+        case ALLOC:    /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = alloc_op(&trace->ops[i])) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            /* Sizes are only kept for -F, to stay out of the timing */
+            if (sized_free)
+                trace->block_sizes[index] = size;
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1217,16 +1580,20 @@ static void eval_mm_speed(void *ptr) {
                 app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
             trace->blocks[index] = newp;
+            if (sized_free)
+                trace->block_sizes[index] = newsize;
             break;
 
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             if (index == (unsigned int)-1) {
                 block = 0;
+                size = 0;
             } else {
                 block = trace->blocks[index];
+                size = sized_free ? trace->block_sizes[index] : 0;
             }
-            mm_free(block);
+            free_op(block, size);
             break;
 
         default:
@@ -1234,6 +1601,285 @@ static void eval_mm_speed(void *ptr) {
         }
 }
 
+/*
+ * alloc_op - Allocate the block of an 'a' or 'm' request of a trace
+ */
+static char *alloc_op(const traceop_t *op) {
+    if (op->type == MEMALIGN)
+        return mm_memalign(op->align, op->size);
+    return mm_malloc(op->size);
+}
+
+/*
+ * free_op - Free a block of a trace, with mm_free_sized and the size it
+ *   was requested with if -F is given
+ */
+static void free_op(char *p, size_t size) {
+    if (sized_free)
+        mm_free_sized(p, size);
+    else
+        mm_free(p);
+}
+
+/*
+ * replay_batched - Replay a trace with each run of two or more mallocs of
+ *   the same size made by one mm_malloc_batch call, and each run of two or
+ *   more frees by one mm_free_batch call.  Given a range set, also check
+ *   each block as eval_mm_valid does and return the high-water mark of the
+ *   payload bytes, or 0 if a block was wrong; otherwise return 0.
+ */
+static size_t replay_batched(trace_t *trace, void **ptrs,
+                             range_set_t *ranges) {
+    unsigned int i, j, k, index;
+    size_t size, newsize;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
+    char *p, *oldp;
+
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in replay_batched");
+
+    for (i = 0; i < trace->num_ops; i = j) {
+        j = i + 1;
+        switch (trace->ops[i].type) {
+
+        case ALLOC:    /* mm_malloc_batch */
+        case MEMALIGN: /* mm_memalign, never batched */
+            size = trace->ops[i].size;
+            while (trace->ops[i].type == ALLOC && j < trace->num_ops &&
+                   trace->ops[j].type == ALLOC && trace->ops[j].size == size)
+                j++;
+            if (j - i == 1)
+                ptrs[0] = alloc_op(&trace->ops[i]);
+            else if (mm_malloc_batch(size, j - i, ptrs) != j - i)
+                ptrs[0] = NULL;
+            if (ptrs[0] == NULL)
+                app_error("mm_malloc_batch error in replay_batched");
+            for (k = i; k < j; k++) {
+                index = trace->ops[k].index;
+                p = ptrs[k - i];
+                if (ranges != NULL) {
+                    if (!add_range(ranges, p, size, trace, k, index))
+                        return 0;
+                    total_size += size;
+                }
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+            }
+            break;
+
+        case REALLOC: /* mm_realloc */
+            index = trace->ops[i].index;
+            newsize = trace->ops[i].size;
+            oldp = trace->blocks[index];
+            setUBCheck(false);
+            if ((p = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+                app_error("mm_realloc error in replay_batched");
+            setUBCheck(true);
+            if (ranges != NULL) {
+                remove_range(ranges, oldp);
+                if (newsize != 0 &&
+                    !add_range(ranges, p, newsize, trace, i, index))
+                    return 0;
+                total_size += newsize - trace->block_sizes[index];
+            }
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = newsize;
+            break;
+
+        case FREE: /* mm_free_batch */
+            while (j < trace->num_ops && trace->ops[j].type == FREE)
+                j++;
+            for (k = i; k < j; k++) {
+                index = trace->ops[k].index;
+                p = index == (unsigned int)-1 ? NULL : trace->blocks[index];
+                if (ranges != NULL && p != NULL) {
+                    remove_range(ranges, p);
+                    total_size -= trace->block_sizes[index];
+                }
+                ptrs[k - i] = p;
+            }
+            if (j - i == 1)
+                mm_free(ptrs[0]);
+            else
+                mm_free_batch(ptrs, j - i);
+            break;
+
+        default:
+            app_error("Nonexistent request type in replay_batched");
+        }
+
+        /* update the high-water mark */
+        max_total_size =
+            (total_size > max_total_size) ? total_size : max_total_size;
+    }
+
+    return max_total_size;
+}
+
+/*
+ * eval_mm_batch_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package with runs of
+ *    requests batched.
+ */
+static void eval_mm_batch_speed(void *ptr) {
+    batch_t *batch = ptr;
+    replay_batched(batch->trace, batch->ptrs, NULL);
+}
+
+/*
+ * eval_mm_batch - Measure the utilization and throughput of a trace with
+ *   runs of mallocs and frees batched, checking the blocks on the way.  A
+ *   utilization of 0 means a block was wrong.
+ */
+static void eval_mm_batch(trace_t *trace, stats_t *stats) {
+    batch_t batch = {trace, calloc(trace->num_ops, sizeof(void *))};
+    if (batch.ptrs == NULL)
+        unix_error("ptrs calloc in eval_mm_batch failed");
+
+    range_set_t *ranges = new_range_set();
+    size_t max_total_size = replay_batched(trace, batch.ptrs, ranges);
+    free_range_set(ranges);
+    stats->batch_util =
+        (double)max_total_size / (double)mem_heapsize_peak();
+
+    if (max_total_size > 0 && !sparse_mode) {
+        stats->batch_tput =
+            stats->ops / (fsec(eval_mm_batch_speed, &batch) * 1000.0);
+    }
+    free(batch.ptrs);
+}
+
+/*
+ * parallel_clock - Wall-clock time in seconds for eval_mm_parallel
+ */
+static double parallel_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * parallel_worker - Body of one thread of eval_mm_parallel.  Stops at
+ *    the first failed request instead of calling app_error, so that
+ *    the other threads can finish.
+ */
+static void *parallel_worker(void *ptr) {
+    parallel_t *par = ptr;
+    const trace_t *trace = par->trace;
+    unsigned int i, index;
+    char *p;
+
+    pthread_barrier_wait(par->barrier);
+    par->start = parallel_clock();
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC:    /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+            if ((p = alloc_op(&trace->ops[i])) == NULL)
+                return NULL;
+            par->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(par->blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0)
+                return NULL;
+            par->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(index == (unsigned int)-1 ? NULL : par->blocks[index]);
+            break;
+
+        default:
+            return NULL;
+        }
+    }
+    par->end = parallel_clock();
+    par->ok = true;
+    return NULL;
+}
+
+/*
+ * run_mm_parallel - Replay the trace once on nthreads threads at once,
+ *    all sharing one heap.  Returns the elapsed seconds, or 0 if any
+ *    request failed.
+ */
+static double run_mm_parallel(trace_t *trace, unsigned int nthreads) {
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    parallel_t *pars = calloc(nthreads, sizeof(parallel_t));
+    pthread_barrier_t barrier;
+    double start = 0, end = 0;
+    unsigned int t;
+    bool ok = true;
+
+    if (tids == NULL || pars == NULL)
+        unix_error("calloc in eval_mm_parallel failed");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_parallel");
+
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++) {
+        pars[t].trace = trace;
+        pars[t].blocks = calloc(trace->num_ids, sizeof(char *));
+        pars[t].barrier = &barrier;
+        if (pars[t].blocks == NULL)
+            unix_error("calloc in eval_mm_parallel failed");
+        if (pthread_create(&tids[t], NULL, parallel_worker, &pars[t]) != 0)
+            unix_error("pthread_create in eval_mm_parallel failed");
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    /* The run lasts from the first thread starting to the last finishing */
+    for (t = 0; t < nthreads; t++) {
+        ok = ok && pars[t].ok;
+        if (t == 0 || pars[t].start < start)
+            start = pars[t].start;
+        if (t == 0 || pars[t].end > end)
+            end = pars[t].end;
+        free(pars[t].blocks);
+    }
+    free(pars);
+    free(tids);
+
+    if (!ok)
+        return 0;
+    return end - start;
+}
+
+/*
+ * eval_mm_parallel - Return the total throughput in Kops/s of the trace
+ *    replayed on nthreads threads at once, best of PARALLEL_RUNS runs,
+ *    or 0 if any request failed.  Only meaningful with a thread-safe
+ *    allocator, i.e. mdriver-mt.
+ */
+static double eval_mm_parallel(trace_t *trace, unsigned int nthreads) {
+    double best = 0;
+    for (int run = 0; run < PARALLEL_RUNS; run++) {
+        double secs = run_mm_parallel(trace, nthreads);
+        if (secs <= 0)
+            return 0;
+        if (best == 0 || secs < best)
+            best = secs;
+    }
+    return (double)nthreads * trace->num_ops / (best * 1000.0);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1258,6 +1904,15 @@ static bool eval_libc_valid(trace_t *trace) {
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) ==
+                NULL) {
+                malloc_error(trace, i, "libc aligned_alloc failed: %s",
+                             strerror(errno));
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1308,6 +1963,14 @@ static void eval_libc_speed(void *ptr) {
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1484,6 +2147,309 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
     }
 }
 
+/*
+ * print_parallel_results - Print the throughput of each trace replayed
+ * on num_threads threads at once, next to the speedup over a single thread.
+ */
+static void print_parallel_results(size_t n, stats_t *stats) {
+    if (tab_mode) {
+        printf("Kops/s\tspeedup\ttrace\n");
+    } else {
+        printf("  %8s %8s  %s\n", "Kops/s", "speedup", "trace");
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].par_tput <= 0) {
+            if (tab_mode) {
+                printf("-\t-\t%s\n", stats[i].filename);
+            } else {
+                printf("  %8s %8s  %s\n", "-", "-", stats[i].filename);
+            }
+            continue;
+        }
+        double speedup = stats[i].par_speedup;
+        if (tab_mode) {
+            printf("%.0f\t%.2f\t%s\n", stats[i].par_tput, speedup,
+                   stats[i].filename);
+        } else {
+            printf("  %8.0f %7.2fx  %s\n", stats[i].par_tput, speedup,
+                   stats[i].filename);
+        }
+    }
+}
+
+/*
+ * print_sbrk_results - Print how often each trace called mem_sbrk, next to
+ * the peak heap size and the average step it grew the heap by.
+ */
+static void print_sbrk_results(size_t n, stats_t *stats) {
+    size_t total = 0;
+    if (tab_mode) {
+        printf("sbrks\tpeak KiB\tKiB/sbrk\ttrace\n");
+    } else {
+        printf("  %8s %9s %9s  %s\n", "sbrks", "peak KiB", "KiB/sbrk",
+               "trace");
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].sbrks == 0) {
+            if (tab_mode) {
+                printf("-\t-\t-\t%s\n", stats[i].filename);
+            } else {
+                printf("  %8s %9s %9s  %s\n", "-", "-", "-",
+                       stats[i].filename);
+            }
+            continue;
+        }
+        double peak = (double)stats[i].peak / 1024.0;
+        double step = peak / (double)stats[i].sbrks;
+        total += stats[i].sbrks;
+        if (tab_mode) {
+            printf("%zu\t%.0f\t%.1f\t%s\n", stats[i].sbrks, peak, step,
+                   stats[i].filename);
+        } else {
+            printf("  %8zu %9.0f %9.1f  %s\n", stats[i].sbrks, peak, step,
+                   stats[i].filename);
+        }
+    }
+    printf("Total mem_sbrk calls = %zu.\n", total);
+}
+
+/*
+ * print_slack_results - Print how many bytes past its request each block
+ * of a trace could use, on average and as a share of its usable bytes.
+ */
+static void print_slack_results(size_t n, stats_t *stats) {
+    if (tab_mode) {
+        printf("blocks\tslack B\tslack\ttrace\n");
+    } else {
+        printf("  %8s %8s %7s  %s\n", "blocks", "slack B", "slack", "trace");
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].slack_blocks == 0) {
+            if (tab_mode) {
+                printf("-\t-\t-\t%s\n", stats[i].filename);
+            } else {
+                printf("  %8s %8s %7s  %s\n", "-", "-", "-",
+                       stats[i].filename);
+            }
+            continue;
+        }
+        if (tab_mode) {
+            printf("%zu\t%.1f\t%.1f%%\t%s\n", stats[i].slack_blocks,
+                   stats[i].slack_avg, stats[i].slack_frac * 100.0,
+                   stats[i].filename);
+        } else {
+            printf("  %8zu %8.1f %6.1f%%  %s\n", stats[i].slack_blocks,
+                   stats[i].slack_avg, stats[i].slack_frac * 100.0,
+                   stats[i].filename);
+        }
+    }
+}
+
+/*
+ * print_counters_results - Print what mm_stats counted over each trace, and
+ * how the heap was split up at the trace's peak of live bytes; then the free
+ * bytes of each seglist bucket at those peaks, added up over the traces.
+ */
+static void print_counters_results(size_t n, stats_t *stats) {
+    if (tab_mode) {
+        printf("sbrks\tsearches\tprobes\tsplits\tcoalesces\tcopy KiB\t"
+               "in use KiB\tfree KiB\tdeferred KiB\tslab KiB\ttrace\n");
+    } else {
+        printf("  %6s %8s %6s %8s %9s %8s  %7s %7s %7s %7s  %s\n", "sbrks",
+               "searches", "probes", "splits", "coalesces", "copy KiB",
+               "in use", "free", "defer", "slab", "trace");
+    }
+    const struct mm_stats *layout = NULL; /* the buckets are the same */
+    double bucket_free[MM_STATS_BUCKETS] = {0};
+    double bucket_depth[MM_STATS_BUCKETS] = {0};
+    double mini_free = 0;
+    size_t traces = 0;
+    for (size_t i = 0; i < n; i++) {
+        const struct mm_stats *end = &stats[i].counters;
+        const struct mm_stats *peak = &stats[i].peak_counters;
+        if (!stats[i].valid || end->buckets == 0) {
+            if (tab_mode) {
+                printf("-\t-\t-\t-\t-\t-\t-\t-\t-\t-\t%s\n",
+                       stats[i].filename);
+            } else {
+                printf("  %6s %8s %6s %8s %9s %8s  %7s %7s %7s %7s  %s\n", "-",
+                       "-", "-", "-", "-", "-", "-", "-", "-", "-",
+                       stats[i].filename);
+            }
+            continue;
+        }
+        size_t free_bytes = peak->mini_free_bytes;
+        for (size_t b = 0; b < peak->buckets; b++) {
+            free_bytes += peak->bucket_free_bytes[b];
+            bucket_free[b] += (double)peak->bucket_free_bytes[b] / 1024.0;
+            bucket_depth[b] += (double)end->bucket_search_depth[b];
+        }
+        traces++;
+        layout = peak;
+        mini_free += (double)peak->mini_free_bytes / 1024.0;
+        double probes = end->fit_searches > 0 ? (double)end->fit_probes /
+                                                    (double)end->fit_searches
+                                              : 0;
+        if (tab_mode) {
+            printf("%zu\t%zu\t%.2f\t%zu\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t"
+                   "%s\n",
+                   end->sbrks, end->fit_searches, probes, end->splits,
+                   end->coalesces, (double)end->realloc_copy_bytes / 1024.0,
+                   (double)peak->in_use_bytes / 1024.0,
+                   (double)free_bytes / 1024.0,
+                   (double)peak->deferred_bytes / 1024.0,
+                   (double)peak->slab_free_bytes / 1024.0, stats[i].filename);
+        } else {
+            printf("  %6zu %8zu %6.2f %8zu %9zu %8.1f  %7.1f %7.1f %7.1f %7.1f "
+                   " %s\n",
+                   end->sbrks, end->fit_searches, probes, end->splits,
+                   end->coalesces, (double)end->realloc_copy_bytes / 1024.0,
+                   (double)peak->in_use_bytes / 1024.0,
+                   (double)free_bytes / 1024.0,
+                   (double)peak->deferred_bytes / 1024.0,
+                   (double)peak->slab_free_bytes / 1024.0, stats[i].filename);
+        }
+    }
+    if (layout == NULL) {
+        return;
+    }
+
+    puts("Free KiB per bucket at the peak of each trace, over all traces,");
+    if (layout->search_limit != 0)
+        printf("and mean search depth at the end (%zu if never tuned, 0 for "
+               "no limit):\n",
+               layout->search_limit);
+    else
+        puts("and mean search depth at the end (0 for no limit):");
+    if (tab_mode) {
+        printf("size\tfree KiB\tdepth\n%d\t%.1f\t-\n", 16, mini_free);
+    } else {
+        printf("  %8s %9s %6s\n  %8d %9.1f %6s\n", "size", "free KiB",
+               "depth", 16, mini_free, "-");
+    }
+    for (size_t b = 0; b < layout->buckets; b++) {
+        double depth = bucket_depth[b] / (double)traces;
+        if (tab_mode) {
+            printf("%zu\t%.1f\t%.1f\n", layout->bucket_min_size[b],
+                   bucket_free[b], depth);
+        } else {
+            printf("  %7zu+ %9.1f %6.1f\n", layout->bucket_min_size[b],
+                   bucket_free[b], depth);
+        }
+    }
+}
+
+/*
+ * print_profile_results - Print how many allocations of each trace the heap
+ * profile sampled, next to how many the sampling rate makes for the bytes
+ * the trace asked for, and how many sampled blocks were live at its peak.
+ */
+static void print_profile_results(size_t n, stats_t *stats) {
+    if (tab_mode) {
+        printf("samples\texpected\tpeak live\tpeak KiB\ttrace\n");
+    } else {
+        printf("  %8s %8s %9s %8s  %s\n", "samples", "expected", "peak live",
+               "peak KiB", "trace");
+    }
+    for (size_t i = 0; i < n; i++) {
+        const struct mm_stats *end = &stats[i].counters;
+        const struct mm_stats *peak = &stats[i].peak_counters;
+        if (!stats[i].valid || end->buckets == 0) {
+            if (tab_mode) {
+                printf("-\t-\t-\t-\t%s\n", stats[i].filename);
+            } else {
+                printf("  %8s %8s %9s %8s  %s\n", "-", "-", "-", "-",
+                       stats[i].filename);
+            }
+            continue;
+        }
+        double expected = (double)stats[i].alloc_bytes / (double)profile_rate;
+        double live_kib = (double)peak->profile_live_bytes / 1024.0;
+        if (tab_mode) {
+            printf("%zu\t%.1f\t%zu\t%.1f\t%s\n", end->profile_samples,
+                   expected, peak->profile_live, live_kib, stats[i].filename);
+        } else {
+            printf("  %8zu %8.1f %9zu %8.1f  %s\n", end->profile_samples,
+                   expected, peak->profile_live, live_kib, stats[i].filename);
+        }
+    }
+}
+
+/*
+ * print_defer_results - Print the utilization and throughput of each trace
+ * with eager and with deferred coalescing, and how much deferring changed.
+ */
+static void print_defer_results(size_t n, stats_t *stats) {
+    if (tab_mode) {
+        printf("util\tdeferred\tKops/s\tdeferred\tspeedup\ttrace\n");
+    } else {
+        printf("  %6s %8s  %8s %8s %8s  %s\n", "util", "deferred", "Kops/s",
+               "deferred", "speedup", "trace");
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].eager_util <= 0) {
+            if (tab_mode) {
+                printf("-\t-\t-\t-\t-\t%s\n", stats[i].filename);
+            } else {
+                printf("  %6s %8s  %8s %8s %8s  %s\n", "-", "-", "-", "-", "-",
+                       stats[i].filename);
+            }
+            continue;
+        }
+        double speedup = stats[i].eager_tput > 0
+                             ? stats[i].defer_tput / stats[i].eager_tput
+                             : 0;
+        if (tab_mode) {
+            printf("%.1f%%\t%.1f%%\t%.0f\t%.0f\t%.2f\t%s\n",
+                   stats[i].eager_util * 100.0, stats[i].defer_util * 100.0,
+                   stats[i].eager_tput, stats[i].defer_tput, speedup,
+                   stats[i].filename);
+        } else {
+            printf("  %5.1f%% %7.1f%%  %8.0f %8.0f %7.2fx  %s\n",
+                   stats[i].eager_util * 100.0, stats[i].defer_util * 100.0,
+                   stats[i].eager_tput, stats[i].defer_tput, speedup,
+                   stats[i].filename);
+        }
+    }
+}
+
+/*
+ * print_batch_results - Print the utilization and throughput of each trace
+ * with one call per request and with runs of requests batched.
+ */
+static void print_batch_results(size_t n, stats_t *stats) {
+    if (tab_mode) {
+        printf("util\tbatched\tKops/s\tbatched\tspeedup\ttrace\n");
+    } else {
+        printf("  %6s %8s  %8s %8s %8s  %s\n", "util", "batched", "Kops/s",
+               "batched", "speedup", "trace");
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].batch_util <= 0) {
+            if (tab_mode) {
+                printf("-\t-\t-\t-\t-\t%s\n", stats[i].filename);
+            } else {
+                printf("  %6s %8s  %8s %8s %8s  %s\n", "-", "-", "-", "-", "-",
+                       stats[i].filename);
+            }
+            continue;
+        }
+        double speedup =
+            stats[i].tput > 0 ? stats[i].batch_tput / stats[i].tput : 0;
+        if (tab_mode) {
+            printf("%.1f%%\t%.1f%%\t%.0f\t%.0f\t%.2f\t%s\n",
+                   stats[i].util * 100.0, stats[i].batch_util * 100.0,
+                   stats[i].tput, stats[i].batch_tput, speedup,
+                   stats[i].filename);
+        } else {
+            printf("  %5.1f%% %7.1f%%  %8.0f %8.0f %7.2fx  %s\n",
+                   stats[i].util * 100.0, stats[i].batch_util * 100.0,
+                   stats[i].tput, stats[i].batch_tput, speedup,
+                   stats[i].filename);
+        }
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1722,4 +2688,20 @@ static void usage(const char *prog) {
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-P <n>     Also replay each trace on <n> threads at "
+                    "once (mdriver-mt).\n");
+    fprintf(stderr, "\t-L         Also compare eager and deferred "
+                    "coalescing.\n");
+    fprintf(stderr, "\t-S         Also report mem_sbrk calls per trace.\n");
+    fprintf(stderr, "\t-U         Also report the usable bytes past each "
+                    "request per trace.\n");
+    fprintf(stderr, "\t-M         Also report the counters of mm_stats per "
+                    "trace.\n");
+    fprintf(stderr, "\t-H <n>     Sample an allocation per <n> bytes for the "
+                    "heap profile.\n");
+    fprintf(stderr, "\t-K <k>     Write the free blocks every <k> ops to "
+                    "<trace>.frag.csv.\n");
+    fprintf(stderr, "\t-F         Free each block with mm_free_sized.\n");
+    fprintf(stderr, "\t-B         Also compare single and batched mallocs "
+                    "and frees.\n");
 }
@@ -71,6 +71,9 @@ static unsigned char *mem_brk; /* Current position of break */
 static unsigned char
     *mem_brk_chunk; /* ditto, rounded up to a whole allocation chunk */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static unsigned char *mem_peak_brk; /* Highest break since the heap was reset */
+static size_t mem_peak_bytes; /* Largest heap plus mapped bytes since reset */
+static size_t mem_sbrk_count; /* Successful mem_sbrk calls since reset */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
@@ -85,6 +88,19 @@ static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
 static size_t num_buckets = 0;             /* Number of buckets in page table */
 
+/* Regions handed out by mem_map, outside of the heap */
+typedef struct {
+    unsigned char *addr; /* First byte of the region */
+    size_t size;         /* Bytes in the region, a multiple of the page size */
+} mem_region_t;
+
+static mem_region_t *regions = NULL; /* Regions in no particular order */
+static size_t num_regions = 0;       /* Number of regions mapped */
+static size_t max_regions = 0;       /* Capacity of regions */
+static size_t mapped_bytes = 0;      /* Total size of the regions */
+static unsigned char *next_region =
+    SPARSE_REGION_START; /* Emulated address of the next sparse region */
+
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
 void setUBCheck(bool val) {}
@@ -114,6 +130,9 @@ static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats(void);
+static void unmap_all(void);
+static void note_footprint(void);
+static bool emulated(const void *addr, size_t len);
 
 /*
  * Internal helpers
@@ -207,6 +226,9 @@ void mem_init(bool do_sparse) {
     stats_printed = false;
     mem_brk = heap;
     mem_brk_chunk = heap;
+    mem_peak_brk = heap;
+    mem_peak_bytes = 0;
+    mem_sbrk_count = 0;
 }
 
 /*
@@ -214,6 +236,10 @@ void mem_init(bool do_sparse) {
  */
 void mem_deinit(void) {
     print_stats();
+    unmap_all();
+    free(regions);
+    regions = NULL;
+    max_regions = 0;
     munmap(heap, mmap_length);
     next_free_page = NULL;
     num_free_pages = 0;
@@ -226,6 +252,7 @@ void mem_deinit(void) {
  */
 void mem_reset_brk(void) {
     print_stats();
+    unmap_all();
     if (sparse) {
         /* Clear page table */
         size_t ptb = num_buckets * sizeof(mem_block_t *);
@@ -251,23 +278,67 @@ void mem_reset_brk(void) {
     }
     mem_brk = heap;
     mem_brk_chunk = heap;
+    mem_peak_brk = heap;
+    mem_peak_bytes = 0;
+    mem_sbrk_count = 0;
+}
+
+/*
+ * mem_shrink - the negative half of mem_sbrk. Whole pages past the new
+ * break go back to the OS; the rest of the last page is cleared, so that
+ * memory the heap grows back into reads as zero like the first time.
+ */
+static void *mem_shrink(intptr_t incr) {
+    unsigned char *old_brk = mem_brk;
+
+    if (mem_brk + incr < heap) {
+        fprintf(stderr,
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, more than its size %zu\n",
+                -(long)incr, mem_heapsize());
+        errno = EINVAL;
+        return (void *)-1;
+    }
+
+    unsigned char *new_brk = old_brk + incr;
+    unsigned char *new_brk_chunk = round_address_up(new_brk, mem_pagesize());
+    if (!sparse) {
+        if (new_brk_chunk < mem_brk_chunk &&
+            (madvise(new_brk_chunk, (size_t)(mem_brk_chunk - new_brk_chunk),
+                     MADV_DONTNEED) == -1 ||
+             mprotect(new_brk_chunk, (size_t)(mem_brk_chunk - new_brk_chunk),
+                      PROT_NONE) == -1)) {
+            fprintf(stderr,
+                    "ERROR: releasing %zd bytes at %p failed (%s)\n",
+                    mem_brk_chunk - new_brk_chunk, (void *)new_brk_chunk,
+                    strerror(errno));
+            return (void *)-1;
+        }
+        /* Past the old break the last page is still zero */
+        unsigned char *dirty_end =
+            old_brk < new_brk_chunk ? old_brk : new_brk_chunk;
+        memset(new_brk, 0, (size_t)(dirty_end - new_brk));
+#ifdef USE_ASAN
+        __asan_poison_memory_region(new_brk, (size_t)(old_brk - new_brk));
+#endif
+    }
+
+    mem_brk_chunk = new_brk_chunk;
+    mem_brk = new_brk;
+    mem_sbrk_count++;
+    return old_brk;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap instead, see mem_shrink.
  */
 void *mem_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     if (incr < 0) {
-        fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
-        errno = EINVAL;
-        return (void *)-1;
+        return mem_shrink(incr);
     }
     if (mem_brk + incr > mem_max_addr) {
         ptrdiff_t alloc = mem_brk - heap + incr;
@@ -311,6 +382,11 @@ void *mem_sbrk(intptr_t incr) {
 
     mem_brk_chunk = new_brk_chunk;
     mem_brk = new_brk;
+    mem_sbrk_count++;
+    if (mem_brk > mem_peak_brk) {
+        mem_peak_brk = mem_brk;
+    }
+    note_footprint();
     return old_brk;
 }
 
@@ -335,6 +411,153 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heapsize_peak - returns the largest heap size since the last reset,
+ * counting the regions from mem_map
+ */
+size_t mem_heapsize_peak(void) {
+    return mem_peak_bytes;
+}
+
+/*
+ * mem_sbrk_calls - returns the number of successful mem_sbrk calls since
+ * the last reset, growing or shrinking the heap
+ */
+size_t mem_sbrk_calls(void) {
+    return mem_sbrk_count;
+}
+
+/*
+ * find_region - the region starting at addr, NULL if there is none
+ */
+static mem_region_t *find_region(const void *addr) {
+    for (size_t i = 0; i < num_regions; i++) {
+        if (regions[i].addr == addr) {
+            return &regions[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * mem_map - simple model of an anonymous mmap. Hands out a region of size
+ * bytes outside of the heap; in sparse mode its address is emulated, and
+ * every region has SPARSE_REGION_SLOT bytes of address space to grow in.
+ */
+void *mem_map(size_t size) {
+    assert(size > 0 && size % mem_pagesize() == 0);
+    if (num_regions == max_regions) {
+        size_t max = max_regions == 0 ? 64 : 2 * max_regions;
+        mem_region_t *grown = realloc(regions, max * sizeof(mem_region_t));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        regions = grown;
+        max_regions = max;
+    }
+
+    unsigned char *addr;
+    if (sparse) {
+        if (size > SPARSE_REGION_SLOT) {
+            fprintf(stderr,
+                    "ERROR: mem_map failed.  Region of %zu bytes is larger "
+                    "than the emulated slot\n",
+                    size);
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        addr = next_region;
+        next_region += SPARSE_REGION_SLOT;
+    } else {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "ERROR: mem_map of %zu bytes failed (%s)\n", size,
+                    strerror(errno));
+            return (void *)-1;
+        }
+    }
+
+    regions[num_regions].addr = addr;
+    regions[num_regions].size = size;
+    num_regions++;
+    mapped_bytes += size;
+    note_footprint();
+    return addr;
+}
+
+/*
+ * mem_remap - resize a region from mem_map, keeping its contents without
+ * copying them. The region may move; a sparse region never does.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+    assert(new_size > 0 && new_size % mem_pagesize() == 0);
+    mem_region_t *region = find_region(addr);
+    if (region == NULL || region->size != old_size) {
+        fprintf(stderr, "ERROR: mem_remap of unknown region %p\n", addr);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+
+    unsigned char *moved = addr;
+    if (sparse) {
+        if (new_size > SPARSE_REGION_SLOT) {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+    } else {
+        moved = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            fprintf(stderr, "ERROR: mem_remap to %zu bytes failed (%s)\n",
+                    new_size, strerror(errno));
+            return (void *)-1;
+        }
+    }
+
+    region->addr = moved;
+    region->size = new_size;
+    mapped_bytes = mapped_bytes - old_size + new_size;
+    note_footprint();
+    return moved;
+}
+
+/*
+ * mem_unmap - give a region from mem_map back
+ */
+int mem_unmap(void *addr, size_t size) {
+    mem_region_t *region = find_region(addr);
+    if (region == NULL || region->size != size) {
+        fprintf(stderr, "ERROR: mem_unmap of unknown region %p\n", addr);
+        errno = EINVAL;
+        return -1;
+    }
+    if (!sparse && munmap(addr, size) == -1) {
+        fprintf(stderr, "ERROR: mem_unmap of %p failed (%s)\n", addr,
+                strerror(errno));
+        return -1;
+    }
+
+    mapped_bytes -= size;
+    *region = regions[--num_regions];
+    return 0;
+}
+
+/*
+ * mem_is_mapped - whether the bytes lo...hi lie in a single region from
+ * mem_map
+ */
+bool mem_is_mapped(const void *lo, const void *hi) {
+    const unsigned char *clo = lo;
+    const unsigned char *chi = hi;
+    for (size_t i = 0; i < num_regions; i++) {
+        if (clo >= regions[i].addr && chi < regions[i].addr + regions[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * mem_pagesize - returns the page size of the system
  */
@@ -368,8 +591,7 @@ void mem_write128(void *addr, __int128_t val) {
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (emulated(addr, len)) {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -407,8 +629,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (emulated(addr, len)) {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -512,8 +733,41 @@ void hprobe(void *ptr, int offset, size_t count) {
 
 /*************** Private Functions *******************/
 
+/* Give back every region, when the heap starts over */
+static void unmap_all(void) {
+    if (!sparse) {
+        for (size_t i = 0; i < num_regions; i++) {
+            munmap(regions[i].addr, regions[i].size);
+        }
+    }
+    num_regions = 0;
+    mapped_bytes = 0;
+    next_region = SPARSE_REGION_START;
+}
+
+/* Update the peak of heap plus mapped bytes */
+static void note_footprint(void) {
+    size_t bytes = mem_heapsize() + mapped_bytes;
+    if (bytes > mem_peak_bytes) {
+        mem_peak_bytes = bytes;
+    }
+}
+
+/* Whether an access goes to the sparse emulation, the heap or a region */
+static bool emulated(const void *addr, size_t len) {
+    const unsigned char *caddr = addr;
+    if (!sparse) {
+        return false;
+    }
+    if (caddr >= heap && caddr + len <= mem_brk) {
+        return true;
+    }
+    return caddr >= (unsigned char *)SPARSE_REGION_START &&
+           caddr + len <= next_region;
+}
+
 static void print_stats(void) {
-    size_t vbytes = mem_heapsize();
+    size_t vbytes = mem_heapsize_peak();
     if (!show_stats || vbytes == 0 || stats_printed)
         return;
     if (sparse) {
@@ -522,10 +776,10 @@ static void print_stats(void) {
         printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes "
                "(%.4f%% density).  Max address = %p\n",
                ppages, num_pages, pbytes, vbytes,
-               100.0 * (double)pbytes / (double)vbytes, (void *)mem_brk);
+               100.0 * (double)pbytes / (double)vbytes, (void *)mem_peak_brk);
     } else {
         printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
-               (void *)mem_brk);
+               (void *)mem_peak_brk);
     }
     stats_printed = true;
 }
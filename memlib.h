@@ -24,15 +24,16 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends the heap by incr bytes, or shrinks it if incr is negative.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. Without sparse
+ * emulation, memory the heap grows into reads as zero, also where it had
+ * been given back before.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -63,6 +64,60 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest size the heap had since it was last reset,
+ *        counting the regions handed out by mem_map().
+ * @return The peak size of the heap and regions, in bytes
+ */
+size_t mem_heapsize_peak(void);
+
+/**
+ * @brief Returns the number of successful mem_sbrk() calls since the heap
+ *        was last reset, growing or shrinking it.
+ * @return The number of calls
+ */
+size_t mem_sbrk_calls(void);
+
+/**
+ * @brief Maps an anonymous region of size bytes outside of the heap.
+ *
+ * This function is a simple model of an anonymous mmap(). The region reads
+ * as zero. Regions are given back by mem_reset_brk() and mem_deinit().
+ *
+ * @param[in] size The size of the region, a multiple of mem_pagesize()
+ * @return The start address of the region, or (void *)-1 on failure
+ */
+void *mem_map(size_t size);
+
+/**
+ * @brief Resizes a region from mem_map() without copying its contents.
+ *
+ * This function is a simple model of mremap() with MREMAP_MAYMOVE.
+ *
+ * @param[in] addr The start address of the region
+ * @param[in] old_size The current size of the region
+ * @param[in] new_size The new size, a multiple of mem_pagesize()
+ * @return The new start address of the region, or (void *)-1 on failure,
+ *         in which case the region is left as it was
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Gives back a region from mem_map().
+ * @param[in] addr The start address of the region
+ * @param[in] size The current size of the region
+ * @return 0 on success, -1 on failure
+ */
+int mem_unmap(void *addr, size_t size);
+
+/**
+ * @brief Checks whether the bytes from lo to hi lie in one region from
+ *        mem_map().
+ * @param[in] lo The first byte
+ * @param[in] hi The last byte
+ */
+bool mem_is_mapped(const void *lo, const void *hi);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -20,13 +20,19 @@
  * @author Junshang Jia <junshanj@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE 1 // for MAP_ANONYMOUS and sigaction
 #include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "memlib.h"
@@ -82,6 +88,127 @@
 #define dbg_printheap(...) ((void)((0) && print_heap(__VA_ARGS__)))
 #endif
 
+/*
+ * Thread safety, off by default. When MM_THREAD_SAFE is 1 the free lists are
+ * split over MM_ARENAS arenas, each guarded by its own lock (see arena_t),
+ * and each thread keeps a small cache of freed blocks per size class in
+ * front of them (see tcache_t), so that only cache misses and cache flushes
+ * take a lock.
+ */
+#ifndef MM_THREAD_SAFE
+#define MM_THREAD_SAFE 0
+#endif
+
+#ifndef MM_ARENAS
+#if MM_THREAD_SAFE
+#define MM_ARENAS 4
+#else
+#define MM_ARENAS 1
+#endif
+#endif
+
+#if MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+/*
+ * Memory mem_sbrk hands out for the first time reads as zero, which lets
+ * calloc skip clearing blocks cut from the untouched end of the heap (see
+ * arena_t.zero_start). Builds whose memory emulation does not promise this
+ * set FRESH_HEAP_ZERO to 0.
+ */
+#ifndef FRESH_HEAP_ZERO
+#define FRESH_HEAP_ZERO 1
+#endif
+
+/*
+ * A free block that ends the heap and reaches TRIM_THRESHOLD bytes more than
+ * the heap may grow ahead (see HEAP_GROWTH_BUDGET) is cut back to that and
+ * the rest handed back to mem_sbrk, so a heap shrinks again after a burst.
+ * 0 never trims.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1 << 17)
+#endif
+
+/*
+ * Requests above MMAP_THRESHOLD bytes get a region of their own from
+ * mem_map, handed back as soon as they are freed, and realloc resizes that
+ * region with mem_remap instead of copying. 0 keeps every block in the heap.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 17)
+#endif
+
+/*
+ * When nothing fits, the heap grows by twice as much as the last time, from
+ * chunksize up to 1/HEAP_GROWTH_BUDGET of what the arena already holds; at
+ * most that share of the heap is left unused by growing ahead. Trimming the
+ * heap starts over at chunksize. 0 always grows by just chunksize.
+ */
+#ifndef HEAP_GROWTH_BUDGET
+#define HEAP_GROWTH_BUDGET 64
+#endif
+
+/*
+ * With DEFER_COALESCE set, free parks small blocks on quick lists of their
+ * exact size without merging them, and malloc takes them back from there
+ * first. Parked blocks are coalesced in one sweep when find_fit misses or
+ * too many bytes are parked. mm_defer_coalescing switches this at run time.
+ */
+#ifndef DEFER_COALESCE
+#define DEFER_COALESCE 0
+#endif
+
+/*
+ * With HEAP_PROFILE set, mm_profile_start samples about one allocation per
+ * so many bytes: a sampled block gets its backtrace and size recorded in a
+ * table mapped outside the heap until it is freed, and mm_profile_dump
+ * writes the live samples as a heap profile pprof reads. An allocation that
+ * is not sampled only counts its bytes down. The interposed build starts
+ * profiling from the environment, see profile_getenv.
+ */
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE 1
+#endif
+
+/*
+ * PLACEMENT picks which free block of a bucket malloc takes. Good fit takes
+ * the smallest of the first few blocks that fit, first fit the
+ * first block that fits, next fit the first that fits from where the last
+ * search of the bucket stopped, and best fit the smallest of all that fit.
+ * The tree of the largest blocks is searched for the best fit whatever the
+ * policy, since that takes no more steps there than any other choice.
+ */
+#define PLACE_GOOD_FIT 0
+#define PLACE_FIRST_FIT 1
+#define PLACE_NEXT_FIT 2
+#define PLACE_BEST_FIT 3
+#ifndef PLACEMENT
+#define PLACEMENT PLACE_GOOD_FIT
+#endif
+
+/*
+ * With good fit, each bucket of each arena learns how many blocks a search
+ * looks at. It starts at SEARCH_LIMIT and goes deeper while searches run out
+ * of depth with blocks left and no good fit, shallower while the best block
+ * turns up in the first half, never past SEARCH_BUDGET.
+ */
+#ifndef SEARCH_BUDGET
+#define SEARCH_BUDGET 32
+#endif
+
+/*
+ * With ADDRESS_ORDER_SIZE set, the lists of the buckets from the one of that
+ * size up keep their blocks in address order instead of pushing freed blocks
+ * at the head, so searches favour the low end of the heap and the top is
+ * left free to be trimmed. Insertion walks the list, which only the short
+ * lists of the large buckets can afford. 0 keeps every list LIFO.
+ */
+#ifndef ADDRESS_ORDER_SIZE
+#define ADDRESS_ORDER_SIZE 0
+#endif
+
 /* Basic constants */
 
 typedef uint64_t word_t;
@@ -101,6 +228,12 @@ static const size_t min_block_size = dsize;
  */
 static const size_t chunksize = (1 << 9);
 
+/**
+ * most extra bytes given to a block that realloc moves for the second time
+ * (Must be divisible by dsize)
+ */
+static const size_t realloc_headroom = (1 << 12);
+
 /**
  *  Mask for extract the LSB
  */
@@ -112,6 +245,23 @@ static const word_t alloc_mask = 0x1;
  */
 static const word_t size_mask = ~(word_t)0xF;
 
+/**
+ * mask for the tag bit of a free mini block header. Sizes are multiples of
+ * 16, so this bit is never set in a normal header; a free mini block instead
+ * stores the address of its predecessor in the mini list in its header, and
+ * since every block address is 8 modulo 16 the address sets this bit itself.
+ */
+static const word_t mini_tag_mask = 0x8;
+
+/**
+ * mask for the same bit in the header of an allocated block, where it marks
+ * a block that a growing realloc already had to move (see realloc)
+ */
+static const word_t realloc_mask = 0x8;
+
+/** mask for the three status bits kept in every header */
+static const word_t flag_mask = 0x7;
+
 /** @brief
  * Struct for pointer of next and prev in free block
  */
@@ -122,11 +272,25 @@ struct Pointer {
 /** @brief
  * Sturct for minimum 16 bytes free block
  *  8 bytes header + 8 bytes next pointer
+ *  (the header doubles as the prev pointer, see mini_tag_mask)
  */
 struct Miniblock {
     struct block *next;
 };
 
+/** @brief
+ * Struct for free block in the last bucket, which is a size-keyed AVL tree.
+ * The first block of each size is a tree node; later blocks of the same size
+ * hang off it in a list through next and prev, and have a non-NULL prev.
+ */
+struct Treenode {
+    struct block *next;
+    struct block *prev;
+    struct block *left;
+    struct block *right;
+    size_t height;
+};
+
 /**
  * union type for payload
  */
@@ -135,6 +299,8 @@ union Data {
     struct Pointer pointer;
     /** @brief sturct for minimum free block equal 16 bytes*/
     struct Miniblock miniblock;
+    /** @brief tree node for free block of at least MAX_SIZE bytes*/
+    struct Treenode treenode;
     /** @brief random data for allocate*/
     char payload[0];
 };
@@ -152,24 +318,302 @@ typedef struct block {
 
 } block_t;
 
+/** @brief sizes below this limit have one exact-size bucket each */
+#define EXACT_LIMIT_LOG2 7
+#define EXACT_LIMIT (1 << EXACT_LIMIT_LOG2)
+/** @brief number of exact-size buckets, 32, 48, ..., EXACT_LIMIT - 16 */
+#define EXACT_BUCKETS (EXACT_LIMIT / 16 - 2)
+/** @brief size great than 16384 will be put in the last index of the list */
+#define MAX_SIZE_LOG2 14
+#define MAX_SIZE (1 << MAX_SIZE_LOG2)
+
+/**
+ * @brief each power of two between EXACT_LIMIT and MAX_SIZE is split into
+ * 2**SUBCLASS_BITS equally spaced size classes. 0 gives one bucket per power
+ * of two; at most EXACT_LIMIT_LOG2 - 4, where classes are 16 bytes apart.
+ */
+#ifndef SUBCLASS_BITS
+#define SUBCLASS_BITS 2
+#endif
+#define SUBCLASSES (1 << SUBCLASS_BITS)
+
 /** @brief Totall bucket size for seglist*/
-#define BUCKET_SIZE 14
-/** @brief size great than 32768 will be put in the last index of the list */
-#define MAX_SIZE 16384
+#define BUCKET_SIZE                                                            \
+    (EXACT_BUCKETS + (MAX_SIZE_LOG2 - EXACT_LIMIT_LOG2) * SUBCLASSES + 1)
 
-/** @brief search limit in the list*/
+/** @brief search limit in the list, where good fit starts each bucket */
+#if PLACEMENT == PLACE_GOOD_FIT
 #define SEARCH_LIMIT 10
+#else
+#define SEARCH_LIMIT SIZE_MAX
+#endif
+
+/** @brief net votes of recent searches a bucket takes to change its depth */
+#define SEARCH_VOTES 16
+
+/** @brief the last bucket, kept as a size-ordered tree instead of a list */
+#define TREE_BUCKET (BUCKET_SIZE - 1)
+
+/** @brief blocks up to this size are kept in the per-thread caches */
+#define TCACHE_MAX_SIZE 256
+/** @brief one cache bin for each block size 16, 32, ..., TCACHE_MAX_SIZE */
+#define TCACHE_BINS (TCACHE_MAX_SIZE / 16)
+/** @brief most blocks a bin holds before part of it goes back to the heap */
+#define TCACHE_DEPTH 16
+/** @brief blocks moved between a bin and the shared heap per lock taken */
+#define TCACHE_BATCH (TCACHE_DEPTH / 2)
+
+/** @brief blocks up to this size are parked when coalescing is deferred */
+#define QUICK_MAX_SIZE 1024
+/** @brief one quick list for each block size 16, 32, ..., QUICK_MAX_SIZE */
+#define QUICK_BINS (QUICK_MAX_SIZE / 16)
+/** @brief bytes an arena may have parked before all of it is coalesced,
+ * which bounds the fragmentation parked blocks cause */
+#define QUICK_MAX_BYTES (1 << 16)
+
+/** @brief moves per pointer mm_free_batch spends on sorting a batch by
+ * address; a batch in random order costs a full sort more than it saves */
+#define SORT_MAX_MOVES 8
+
+/** @brief an arena that can not grow its last chunk in place starts a new
+ * chunk of at least this many bytes */
+#define ARENA_CHUNK_SIZE (1 << 16)
+/** @brief capacity of the table mapping heap chunks to their arena */
+#define ARENA_MAX_CHUNKS 4096
+
+/**
+ * @brief requests up to this many bytes are packed into slab runs, without a
+ * header per object; 0 turns slabs off. The thread-safe build leaves small
+ * requests to the per-thread caches by default.
+ */
+#ifndef SLAB_MAX_SIZE
+#if MM_THREAD_SAFE
+#define SLAB_MAX_SIZE 0
+#else
+#define SLAB_MAX_SIZE 128
+#endif
+#endif
+/** @brief one list of runs for each object size 16, 32, ..., SLAB_MAX_SIZE */
+#define SLAB_CLASSES (SLAB_MAX_SIZE / 16)
+/** @brief bytes of heap per run, runs start at a multiple of their size */
+#define SLAB_RUN_SIZE (1 << 12)
+/** @brief requests an object size takes from the seglist before it gets a
+ * run, so that a few small objects do not each hold a whole run */
+#ifndef SLAB_WARMUP
+#define SLAB_WARMUP 32
+#endif
+/** @brief bytes an arena holds before it makes any run */
+#ifndef SLAB_MIN_HEAP
+#define SLAB_MIN_HEAP (1 << 16)
+#endif
+/** @brief words in the map of free objects of a run */
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / 16 / 64)
+/** @brief runs are only placed this many bytes into the heap, the span
+ * slab_pages covers */
+#define SLAB_SPAN (1UL << 28)
+
+/** @brief slots of the table of sampled blocks, at most 3/4 of them used */
+#define PROFILE_SLOTS_LOG2 14
+#define PROFILE_SLOTS (1 << PROFILE_SLOTS_LOG2)
+/** @brief return addresses kept of the backtrace of a sampled block */
+#define PROFILE_DEPTH 24
+/** @brief counters of the filter telling unsampled blocks apart at free */
+#define PROFILE_FILTER (1 << 16)
+/** @brief bytes a thread allocates between looking whether profiling was
+ * started, while it is off */
+#define PROFILE_RECHECK (1 << 20)
 
 /* Global variables */
 
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
-/** @brief the free block size for each seglist bucket is {32,48, 64,
- * 80,96,112,2**(i+1)..... }
- *
+typedef struct slab slab_t;
+
+/**
+ * @brief the counters of an arena behind mm_stats, kept up to date as blocks
+ * move on and off the lists so that reading them never walks the heap
+ */
+typedef struct {
+    /** @brief bytes of the free blocks in each seglist bucket */
+    size_t free_bytes[BUCKET_SIZE];
+    /** @brief bytes of the free mini blocks */
+    size_t mini_bytes;
+    /** @brief bytes of the free objects in slab runs */
+    size_t slab_free_bytes;
+    /** @brief times the arena extended the heap */
+    size_t sbrks;
+    /** @brief searches of the seglist for a fit */
+    size_t fit_searches;
+    /** @brief free blocks (or tree nodes) those searches looked at */
+    size_t fit_probes;
+    /** @brief blocks split, giving back what they have beyond a request */
+    size_t splits;
+    /** @brief free neighbours merged into a block being freed */
+    size_t coalesces;
+} arena_stats_t;
+
+/**
+ * @brief An arena owns a set of free lists and the heap chunks their blocks
+ * live in. A chunk is a stretch of the heap with its own prologue and
+ * epilogue; the first chunk starts at mem_heap_lo, and an arena grows its
+ * last chunk in place for as long as that chunk ends the heap.
+ */
+typedef struct {
+    /** @brief the free block size for each seglist bucket is {32,48, 64,
+     * 80,96,112,128,160,192,224,256,320..... } (with SUBCLASS_BITS = 2)
+     */
+    block_t *seglist[BUCKET_SIZE];
+
+    /** @brief bit i is set if and only if seglist[i] is not empty */
+    word_t seglist_bitmap;
+
+#if PLACEMENT == PLACE_NEXT_FIT
+    /** @brief block of each bucket the next search starts at, NULL for the
+     * head of the list */
+    block_t *rover[BUCKET_SIZE];
+#endif
+
+#if PLACEMENT == PLACE_GOOD_FIT
+    /** @brief blocks a search of each bucket looks at, see tune_depth */
+    size_t search_depth[BUCKET_SIZE];
+
+    /** @brief votes of the recent searches of each bucket, for a deeper
+     * search if positive and a shallower one if negative */
+    int search_votes[BUCKET_SIZE];
+
+    /** @brief whether each bucket has been searched since mm_init, so that
+     * mm_stats leaves out the depths of buckets this arena never used */
+    bool searched[BUCKET_SIZE];
+#endif
+
+    /** @brief minimum free block list */
+    block_t *small_block_start;
+
+    /** @brief epilogue of the chunk this arena grew last */
+    block_t *epilogue;
+
+    /** @brief every word from here up to the epilogue is still zero from
+     * mem_sbrk, except the free list links and footer of the free block that
+     * ends the chunk; at or past the epilogue if nothing is known to be zero
+     */
+    char *zero_start;
+
+    /** @brief runs with a free object, for each object size */
+    slab_t *slabs[SLAB_CLASSES];
+
+    /** @brief requests of each object size served from the seglist while
+     * it had no run, up to SLAB_WARMUP */
+    size_t slab_waits[SLAB_CLASSES];
+
+    /** @brief freed blocks waiting to be coalesced, for each block size;
+     * they stay marked as allocated until then */
+    block_t *quick[QUICK_BINS];
+
+    /** @brief bytes of the blocks on the quick lists */
+    size_t quick_bytes;
+
+    /** @brief bytes of heap the arena got from mem_sbrk and still holds */
+    size_t heap_bytes;
+
+    /** @brief how far the heap grows next when nothing fits */
+    size_t grow_step;
+
+    /** @brief counters read by mm_stats */
+    arena_stats_t stats;
+
+#if MM_THREAD_SAFE
+    /** @brief guards everything above and the blocks of the arena's chunks */
+    pthread_mutex_t lock;
+#endif
+} arena_t;
+_Static_assert(BUCKET_SIZE <= 64, "seglist_bitmap holds one bit per bucket");
+_Static_assert(BUCKET_SIZE <= MM_STATS_BUCKETS,
+               "mm_stats reports on every bucket");
+_Static_assert(SUBCLASS_BITS >= 0 && SUBCLASS_BITS <= EXACT_LIMIT_LOG2 - 4,
+               "size classes must be at least 16 bytes apart");
+_Static_assert(MM_ARENAS >= 1 && (MM_ARENAS == 1 || MM_THREAD_SAFE),
+               "several arenas are only useful in the thread-safe build");
+
+/** @brief all arenas, threads are bound to them round-robin */
+static arena_t arenas[MM_ARENAS];
+
+/** @brief whether free parks blocks on the quick lists, fixed by mm_init */
+static bool defer_coalescing = false;
+
+/** @brief what the next mm_init sets defer_coalescing to */
+static bool defer_requested = DEFER_COALESCE;
+
+/** @brief bytes of the regions of mapped blocks, guarded by the sbrk lock */
+static size_t mapped_bytes = 0;
+
+/** @brief reallocs that moved a block and the bytes they copied; added to
+ * atomically, as the copy happens without an arena lock */
+static size_t realloc_copies = 0;
+static size_t realloc_copy_bytes = 0;
+
+/** @brief a sampled block in the table of the heap profile */
+typedef struct {
+    /** @brief payload of the block, NULL if the slot is free */
+    void *ptr;
+    /** @brief bytes asked for */
+    size_t size;
+    /** @brief number of return addresses in frames */
+    size_t depth;
+    /** @brief backtrace of the allocation, innermost first */
+    void *frames[PROFILE_DEPTH];
+} profile_entry_t;
+
+/** @brief the sampled blocks, by a hash of their address with linear
+ * probing; mapped outside the heap by the first mm_profile_start */
+static profile_entry_t *profile_table = NULL;
+
+/** @brief in the same mapping, how many sampled blocks fall in each bucket
+ * of addresses, so free finds most blocks unsampled with one load */
+static uint16_t *profile_filter = NULL;
+
+/** @brief mean bytes between samples, 0 while profiling is off */
+static size_t profile_rate = 0;
+
+/** @brief sampled blocks in the table and the bytes they asked for */
+static size_t profile_live = 0;
+static size_t profile_live_bytes = 0;
+
+/** @brief blocks sampled since mm_init */
+static size_t profile_samples = 0;
+
+/** @brief set by the dump signal; the next sample dumps the profile */
+static volatile sig_atomic_t profile_dump_pending = 0;
+
+/** @brief file a dump on signal goes to, NULL for stderr */
+static const char *profile_path = NULL;
+
+/**
+ * @brief A slab run is an allocated block of SLAB_RUN_SIZE bytes whose
+ * payload starts at a multiple of SLAB_RUN_SIZE, so an object finds its run
+ * by rounding its address down. The run holds objects of a single size
+ * packed right after this header.
  */
-static block_t *seglist[BUCKET_SIZE];
+struct slab {
+    /** @brief next run of the same size with a free object */
+    struct slab *next;
+    /** @brief previous run of the same size with a free object */
+    struct slab *prev;
+    /** @brief arena owning the block of the run */
+    arena_t *arena;
+    /** @brief object size */
+    uint32_t size;
+    /** @brief number of free objects */
+    uint32_t free;
+    /** @brief bit i is set if object i is free */
+    word_t free_map[SLAB_MAP_WORDS];
+};
+_Static_assert(sizeof(slab_t) % 16 == 0, "slab objects must stay aligned");
+_Static_assert(SLAB_MAX_SIZE % 16 == 0, "slab sizes are multiples of 16");
+
+/** @brief bit i is set if the i-th SLAB_RUN_SIZE bytes from the heap start
+ * hold a slab run; tells slab objects from ordinary blocks */
+static word_t slab_pages[SLAB_SPAN / SLAB_RUN_SIZE / 64];
 
 /*mask for extract the status of previous allocation bit*/
 static const word_t prev_alloc_mask = 0x2;
@@ -177,8 +621,83 @@ static const word_t prev_alloc_mask = 0x2;
 /*mask for extract the status of previous minimum block*/
 static const word_t prev_small_mask = 0x4;
 
-/*minimum free block list*/
-static block_t *small_block_start = NULL;
+#if MM_THREAD_SAFE
+/** @brief the arena whose lock the calling thread holds, which the free list
+ * functions work on */
+static _Thread_local arena_t *cur_arena = &arenas[0];
+
+/** @brief the arena the calling thread allocates from, NULL until first use */
+static _Thread_local arena_t *thread_arena;
+
+/** @brief number of threads bound to an arena so far */
+static unsigned int arena_next = 0;
+
+/** @brief initializes the arena locks once */
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/** @brief a chunk of the heap and the arena owning it */
+typedef struct {
+    /** @brief address of the chunk prologue */
+    char *start;
+    /** @brief arena owning every block of the chunk */
+    arena_t *arena;
+} chunk_t;
+
+/** @brief every chunk of the heap in address order, published with release
+ * stores of chunk_count so arena_of can search it without a lock */
+static chunk_t chunks[ARENA_MAX_CHUNKS];
+static size_t chunk_count = 0;
+
+/** @brief guards mem_sbrk and the chunk table */
+static pthread_mutex_t sbrk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief serializes the lazy mm_init of the first malloc */
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief per-thread cache of freed blocks. A cached block stays marked as
+ * allocated in the heap, so the shared structures never see it; the bins are
+ * singly linked through the first payload word.
+ */
+typedef struct {
+    /** @brief bins[i] holds blocks of size 16 * (i + 1) */
+    block_t *bins[TCACHE_BINS];
+    /** @brief number of blocks in each bin */
+    size_t count[TCACHE_BINS];
+    /** @brief value of heap_generation the cached blocks belong to */
+    word_t generation;
+    /** @brief whether the cache is flushed when the thread exits */
+    bool registered;
+} tcache_t;
+
+/** @brief bumped by mm_init, invalidates blocks cached from an older heap */
+static word_t heap_generation = 0;
+
+/** @brief key whose destructor returns a thread's cache on exit */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/** @brief the calling thread's cache */
+static _Thread_local tcache_t tcache;
+
+/** @brief guards the table of the heap profile */
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief bytes the calling thread allocates before its next sample */
+static _Thread_local size_t profile_countdown = 0;
+
+/** @brief state of the calling thread's random sample intervals */
+static _Thread_local uint64_t profile_seed = 0;
+#else
+/** @brief the only arena */
+static arena_t *cur_arena = &arenas[0];
+
+/** @brief bytes allocated before the next sample */
+static size_t profile_countdown = 0;
+
+/** @brief state of the random sample intervals */
+static uint64_t profile_seed = 0;
+#endif
 
 /** the head of the free list*/
 
@@ -255,12 +774,16 @@ static word_t pack(size_t size, bool alloc, bool prev_alloc, bool mini_status) {
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. The header of a free mini block holds a list pointer
+ * instead, which is recognised by its tag bit.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
+    if ((word & (mini_tag_mask | alloc_mask)) == mini_tag_mask) {
+        return min_block_size;
+    }
     return (word & size_mask);
 }
 
@@ -321,6 +844,21 @@ static block_t *footer_to_header(word_t *footer) {
     return (block_t *)((char *)footer + wsize - size);
 }
 
+/**
+ * @brief Returns the size of an allocated block, read by its owner without
+ * the heap lock.
+ *
+ * A neighbour being freed or allocated may rewrite the status bits of this
+ * header at the same time, so the header is loaded atomically; the size
+ * bits themselves only change while the block is free.
+ *
+ * @param[in] block
+ * @return The size of the block
+ */
+static size_t get_owned_size(block_t *block) {
+    return extract_size(__atomic_load_n(&block->header, __ATOMIC_RELAXED));
+}
+
 /**
  * @brief Returns the payload size of a given block.
  *
@@ -331,7 +869,11 @@ static block_t *footer_to_header(word_t *footer) {
  * @return The size of the block's payload
  */
 static size_t get_payload_size(block_t *block) {
-    size_t asize = get_size(block);
+    size_t asize = get_owned_size(block);
+    if (asize == 0) {
+        // A mapped block, the region size is in the word before its header
+        return *((word_t *)block - 1) - 2 * wsize;
+    }
     return asize - wsize;
 }
 
@@ -388,19 +930,86 @@ static block_t **get_prev(block_t *block) {
     return &(block->data.pointer.prev);
 }
 
+/**
+ * @brief Maps a block size to its bucket in the seglist in constant time.
+ *
+ * Sizes below `EXACT_LIMIT` each have their own bucket (32, 48, ..., 112).
+ * Larger sizes are bucketed by the position of their highest set bit, which
+ * is found with a single count-leading-zeros instruction instead of a loop
+ * over the candidate buckets, and then by the next SUBCLASS_BITS bits below
+ * it. Everything at or above `MAX_SIZE` goes to the last bucket.
+ *
+ * @param[in] size The size of a block (a multiple of dsize)
+ * @return The index of the bucket that holds blocks of that size
+ */
+static size_t get_bucket(size_t size) {
+    if (size >= MAX_SIZE) {
+        return BUCKET_SIZE - 1;
+    }
+    if (size < EXACT_LIMIT) {
+        /* the 16 bytes mini block has no bucket, start searching from 32 */
+        return size < 2 * dsize ? 0 : size / dsize - 2;
+    }
+    size_t log2 = (size_t)(63 - __builtin_clzl((unsigned long)size));
+    size_t sub = (size >> (log2 - SUBCLASS_BITS)) & (SUBCLASSES - 1);
+    return EXACT_BUCKETS + (log2 - EXACT_LIMIT_LOG2) * SUBCLASSES + sub;
+}
+
+/**
+ * @brief Returns the smallest block size that belongs to a bucket, the
+ * inverse of get_bucket.
+ *
+ * Bucket i holds the sizes in [bucket_min_size(i), bucket_min_size(i + 1)),
+ * the last bucket holds everything from MAX_SIZE up.
+ *
+ * @param[in] index The index of a bucket in the seglist
+ * @return The lower bound of the sizes in that bucket
+ */
+static size_t bucket_min_size(size_t index) {
+    if (index < EXACT_BUCKETS) {
+        return (index + 2) * dsize;
+    }
+    if (index >= BUCKET_SIZE - 1) {
+        return MAX_SIZE;
+    }
+    size_t log2 = EXACT_LIMIT_LOG2 + (index - EXACT_BUCKETS) / SUBCLASSES;
+    size_t sub = (index - EXACT_BUCKETS) % SUBCLASSES;
+    return ((size_t)1 << log2) + sub * ((size_t)1 << (log2 - SUBCLASS_BITS));
+}
+
 /**
  * @brief Add free block in the free list
  * @param[in] block the free block
- * @param[in] free_head head of the specific size in the seglist
+ * @param[in] index index of the bucket in the seglist
  */
-static void add_free_list(block_t *block, block_t **free_head) {
+static void add_free_list(block_t *block, size_t index) {
+    block_t **free_head = &cur_arena->seglist[index];
     block_t **next = get_next(block);
     block_t **prev = get_prev(block);
     if (block == *free_head) {
         return;
     }
+    cur_arena->stats.free_bytes[index] += get_size(block);
+#if ADDRESS_ORDER_SIZE
+    /* an address-ordered list takes the block after the last lower one */
+    if (index >= get_bucket(ADDRESS_ORDER_SIZE) && *free_head != NULL &&
+        *free_head < block) {
+        block_t *after = *free_head;
+        while (*get_next(after) != NULL && *get_next(after) < block) {
+            after = *get_next(after);
+        }
+        *next = *get_next(after);
+        *prev = after;
+        if (*next != NULL) {
+            *get_prev(*next) = block;
+        }
+        *get_next(after) = block;
+        return;
+    }
+#endif
     if (*free_head == NULL) {
         *free_head = block;
+        cur_arena->seglist_bitmap |= (word_t)1 << index;
 
         *next = NULL;
         *prev = NULL;
@@ -417,9 +1026,17 @@ static void add_free_list(block_t *block, block_t **free_head) {
 /**
  * @brief remove free block in the free list
  * @param[in] block the free block
- * @param[in] free_head head of the specific size in the seglist
+ * @param[in] index index of the bucket in the seglist
  */
-static void remove_from_list(block_t *block, block_t **free_head) {
+static void remove_from_list(block_t *block, size_t index) {
+    block_t **free_head = &cur_arena->seglist[index];
+    cur_arena->stats.free_bytes[index] -= get_size(block);
+#if PLACEMENT == PLACE_NEXT_FIT
+    /* the search carries on from the block after the one taken */
+    if (cur_arena->rover[index] == block) {
+        cur_arena->rover[index] = *get_next(block);
+    }
+#endif
     /* if the removed block is the head*/
     if (block == *free_head) {
         block_t **next = get_next(block);
@@ -431,6 +1048,7 @@ static void remove_from_list(block_t *block, block_t **free_head) {
 
         } else {
             *free_head = NULL;
+            cur_arena->seglist_bitmap &= ~((word_t)1 << index);
         }
 
     } else {
@@ -453,64 +1071,246 @@ static void remove_from_list(block_t *block, block_t **free_head) {
         *next = NULL;
     }
 }
+
 /**
- * @brief search the bucket based on the size of the block
+ * @brief Return the address of the left child pointer of a tree node
  * @param[in] block
- * @return the head of the specific size list in the seglist
+ * @return The address of the left child pointer in the block
  */
-static block_t **search_seg(block_t *block) {
-    size_t size = get_size(block);
-    /* if the size greater than maximum size, put it in the last index of the
-     * seglist*/
-    if (size >= MAX_SIZE) {
-        return &seglist[BUCKET_SIZE - 1];
+static block_t **get_left(block_t *block) {
+    return &(block->data.treenode.left);
+}
+
+/**
+ * @brief Return the address of the right child pointer of a tree node
+ * @param[in] block
+ * @return The address of the right child pointer in the block
+ */
+static block_t **get_right(block_t *block) {
+    return &(block->data.treenode.right);
+}
+
+/**
+ * @brief Returns the height of a subtree, 0 for an empty one
+ * @param[in] node
+ * @return the height of the subtree rooted at node
+ */
+static size_t tree_height(block_t *node) {
+    return node == NULL ? 0 : node->data.treenode.height;
+}
+
+/**
+ * @brief Recomputes the height of a node from its children
+ * @param[in] node
+ */
+static void tree_update_height(block_t *node) {
+    node->data.treenode.height =
+        max(tree_height(*get_left(node)), tree_height(*get_right(node))) + 1;
+}
+
+/**
+ * @brief Rotates the subtree rooted at node to the left
+ * @param[in] node
+ * @return the new root of the subtree
+ */
+static block_t *tree_rotate_left(block_t *node) {
+    block_t *right = *get_right(node);
+    *get_right(node) = *get_left(right);
+    *get_left(right) = node;
+    tree_update_height(node);
+    tree_update_height(right);
+    return right;
+}
+
+/**
+ * @brief Rotates the subtree rooted at node to the right
+ * @param[in] node
+ * @return the new root of the subtree
+ */
+static block_t *tree_rotate_right(block_t *node) {
+    block_t *left = *get_left(node);
+    *get_left(node) = *get_right(left);
+    *get_right(left) = node;
+    tree_update_height(node);
+    tree_update_height(left);
+    return left;
+}
+
+/**
+ * @brief Restores the AVL balance of a node whose subtrees differ in height
+ * by at most two, after an insertion or removal below it.
+ *
+ * @param[in] node
+ * @return the new root of the subtree
+ */
+static block_t *tree_rebalance(block_t *node) {
+    size_t left_height = tree_height(*get_left(node));
+    size_t right_height = tree_height(*get_right(node));
+
+    if (left_height > right_height + 1) {
+        block_t *left = *get_left(node);
+        if (tree_height(*get_right(left)) > tree_height(*get_left(left))) {
+            *get_left(node) = tree_rotate_left(left);
+        }
+        return tree_rotate_right(node);
     }
-    /* search first five special size of buckets, 32 48,64,80,96*/
-    for (size_t i = 0; i < 6; i++) {
-        size_t current_size = 32 + (16 * i);
-        if (current_size == size) {
-            return &seglist[i];
+    if (right_height > left_height + 1) {
+        block_t *right = *get_right(node);
+        if (tree_height(*get_left(right)) > tree_height(*get_right(right))) {
+            *get_right(node) = tree_rotate_right(right);
         }
+        return tree_rotate_left(node);
     }
+    tree_update_height(node);
+    return node;
+}
 
-    /* search later buckets size based on the power of 2*/
-    for (size_t i = 6; i < BUCKET_SIZE; i++) {
-
-        size_t current_size = 1 << (i + 1);
-        if (current_size > size) {
+/**
+ * @brief Inserts a free block into the size-ordered tree. A block whose size
+ * is already in the tree is linked behind that node instead.
+ *
+ * @param[in] root root of the (sub)tree
+ * @param[in] block the free block
+ * @return the new root of the (sub)tree
+ */
+static block_t *tree_insert(block_t *root, block_t *block) {
+    if (root == NULL) {
+        *get_next(block) = NULL;
+        *get_prev(block) = NULL;
+        *get_left(block) = NULL;
+        *get_right(block) = NULL;
+        block->data.treenode.height = 1;
+        return block;
+    }
 
-            return &seglist[i - 1];
+    size_t size = get_size(block);
+    size_t root_size = get_size(root);
+    if (size == root_size) {
+        block_t *next = *get_next(root);
+        *get_next(block) = next;
+        *get_prev(block) = root;
+        if (next != NULL) {
+            *get_prev(next) = block;
         }
+        *get_next(root) = block;
+        return root;
     }
-    dbg_printf("search failed,error\n");
-    return NULL;
+
+    if (size < root_size) {
+        *get_left(root) = tree_insert(*get_left(root), block);
+    } else {
+        *get_right(root) = tree_insert(*get_right(root), block);
+    }
+    return tree_rebalance(root);
 }
+
 /**
- * @brief search the bucket based on the size
- * @param[in] block
- * @return the head of the specific size list in the seglist
+ * @brief Detaches the smallest node of a non-empty subtree
+ * @param[in] root root of the subtree
+ * @param[out] min the detached node
+ * @return the new root of the subtree
  */
-static size_t search_seg_by_size(size_t size) {
-    if (size > MAX_SIZE) {
-        return BUCKET_SIZE - 1;
+static block_t *tree_remove_min(block_t *root, block_t **min) {
+    if (*get_left(root) == NULL) {
+        *min = root;
+        return *get_right(root);
     }
-    for (size_t i = 0; i < 6; i++) {
-        size_t current_size = 32 + (16 * i);
-        if (current_size == size) {
-            return i;
+    *get_left(root) = tree_remove_min(*get_left(root), min);
+    return tree_rebalance(root);
+}
+
+/**
+ * @brief Removes a tree node from the size-ordered tree. If other blocks of
+ * the same size are waiting behind it, the first of them takes its place.
+ *
+ * @param[in] root root of the (sub)tree that contains node
+ * @param[in] node the node to remove
+ * @return the new root of the (sub)tree
+ */
+static block_t *tree_delete(block_t *root, block_t *node) {
+    if (root != node) {
+        if (get_size(node) < get_size(root)) {
+            *get_left(root) = tree_delete(*get_left(root), node);
+        } else {
+            *get_right(root) = tree_delete(*get_right(root), node);
         }
+        return tree_rebalance(root);
+    }
+
+    block_t *left = *get_left(node);
+    block_t *right = *get_right(node);
+    block_t *replacement = *get_next(node);
+    if (replacement != NULL) {
+        *get_prev(replacement) = NULL;
+        *get_left(replacement) = left;
+        *get_right(replacement) = right;
+        replacement->data.treenode.height = node->data.treenode.height;
+        return replacement;
     }
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    block_t *successor;
+    right = tree_remove_min(right, &successor);
+    *get_left(successor) = left;
+    *get_right(successor) = right;
+    return tree_rebalance(successor);
+}
 
-    for (size_t i = 6; i < BUCKET_SIZE; i++) {
+/**
+ * @brief Removes a free block from the size-ordered tree. Blocks that are
+ * not tree nodes are unlinked in constant time.
+ *
+ * @param[in] root root of the tree
+ * @param[in] block the free block
+ * @return the new root of the tree
+ */
+static block_t *tree_remove(block_t *root, block_t *block) {
+    block_t *prev = *get_prev(block);
+    if (prev == NULL) {
+        return tree_delete(root, block);
+    }
 
-        size_t current_size = 1 << (i + 1);
-        if (current_size > size) {
+    block_t *next = *get_next(block);
+    *get_next(prev) = next;
+    if (next != NULL) {
+        *get_prev(next) = prev;
+    }
+    return root;
+}
 
-            return i - 1;
+/**
+ * @brief Finds the smallest free block in the tree that is at least asize
+ * bytes, preferring a block that is not a tree node so that taking it does
+ * not restructure the tree.
+ *
+ * @param[in] root root of the tree
+ * @param[in] asize
+ * @return the best fitting block, or NULL if every block is too small
+ */
+static block_t *tree_best_fit(block_t *root, size_t asize) {
+    block_t *best = NULL;
+    block_t *node = root;
+    while (node != NULL) {
+        cur_arena->stats.fit_probes++;
+        size_t size = get_size(node);
+        if (size < asize) {
+            node = *get_right(node);
+        } else {
+            best = node;
+            if (size == asize) {
+                break;
+            }
+            node = *get_left(node);
         }
     }
-    dbg_printf("search failed,error\n");
-    return 1;
+    if (best != NULL && *get_next(best) != NULL) {
+        return *get_next(best);
+    }
+    return best;
 }
 
 /**
@@ -518,16 +1318,32 @@ static size_t search_seg_by_size(size_t size) {
  * @param[in] block the free block
  */
 static void add_seg_list(block_t *block) {
-    block_t **head = search_seg(block);
-    add_free_list(block, head);
+    size_t index = get_bucket(get_size(block));
+    if (index == TREE_BUCKET) {
+        cur_arena->seglist[TREE_BUCKET] =
+            tree_insert(cur_arena->seglist[TREE_BUCKET], block);
+        cur_arena->seglist_bitmap |= (word_t)1 << TREE_BUCKET;
+        cur_arena->stats.free_bytes[TREE_BUCKET] += get_size(block);
+        return;
+    }
+    add_free_list(block, index);
 }
 /**
  * @brief remove free block in the segist
  * @param[in] block the free block
  */
 static void remove_seg_list(block_t *block) {
-    block_t **head = search_seg(block);
-    remove_from_list(block, head);
+    size_t index = get_bucket(get_size(block));
+    if (index == TREE_BUCKET) {
+        cur_arena->seglist[TREE_BUCKET] =
+            tree_remove(cur_arena->seglist[TREE_BUCKET], block);
+        cur_arena->stats.free_bytes[TREE_BUCKET] -= get_size(block);
+        if (cur_arena->seglist[TREE_BUCKET] == NULL) {
+            cur_arena->seglist_bitmap &= ~((word_t)1 << TREE_BUCKET);
+        }
+        return;
+    }
+    remove_from_list(block, index);
 }
 /**
  * @brief Finds the next consecutive block on the heap.
@@ -563,8 +1379,14 @@ static void modify_next_prev_state(block_t *block, bool alloc,
                                    bool mini_status) {
     block_t *next_header = find_next(block);
 
-    next_header->header =
-        pack(get_size(next_header), get_alloc(next_header), alloc, mini_status);
+    /* only touch the two status bits, the rest of the header may be the
+     * mini list pointer of a free mini block */
+    word_t others = next_header->header & ~(prev_alloc_mask | prev_small_mask);
+    /* the next block may be allocated and its size read by its owner
+     * without the heap lock, see get_owned_size */
+    __atomic_store_n(&next_header->header,
+                     others | pack(0, false, alloc, mini_status),
+                     __ATOMIC_RELAXED);
 }
 /**
  * The function extracts the previous allocation status from a given header.
@@ -689,54 +1511,75 @@ static block_t *find_prev(block_t *block) {
 }
 
 /**
- * @brief removes a specific block from a singly linked list called
- * small_block_start.
+ * @brief returns the predecessor of a free mini block in the mini list,
+ * which is kept in its header.
  *
- * @param block
+ * @param block A free mini block
  *
+ * @return the previous mini block, or NULL if block is the head
  */
-static void remove_small_list(block_t *block) {
-    if (block == small_block_start) {
-        block_t *next = block->data.miniblock.next;
-        if (next != NULL) {
-            block->data.miniblock.next = NULL;
-            small_block_start = next;
-
-        } else {
-            small_block_start = NULL;
-        }
-    } else {
-        block_t *prev = NULL;
-        block_t *current = small_block_start;
-
-        while (current != NULL) {
-            if (current == block) {
-                block_t *next = current->data.miniblock.next;
-                prev->data.miniblock.next = next;
-                current->data.miniblock.next = NULL;
-                return;
-            }
-            prev = current;
-            current = current->data.miniblock.next;
-        }
+static block_t *get_mini_prev(block_t *block) {
+    word_t prev = block->header & ~flag_mask;
+    if (prev == mini_tag_mask) {
+        return NULL;
     }
+    return (block_t *)prev;
 }
 
 /**
- * @brief add a specific block from a singly linked list called
- * small_block_start.
- *
- * @param block
+ * @brief stores the predecessor of a free mini block in its header, keeping
+ * the status bits.
  *
+ * @param block A free mini block
+ * @param prev The previous mini block, or NULL if block is the head
  */
-static void add_small_list(block_t *block) {
-    block->data.miniblock.next = NULL;
-    if (small_block_start == NULL) {
-        small_block_start = block;
+static void set_mini_prev(block_t *block, block_t *prev) {
+    dbg_requires(prev == NULL || ((word_t)prev & mini_tag_mask) != 0);
+    block->header = (word_t)prev | mini_tag_mask | (block->header & flag_mask);
+}
+
+/**
+ * @brief removes a specific block from a doubly linked list called
+ * small_block_start in constant time. The header of the block is restored
+ * to a normal free mini block header.
+ *
+ * @param block
+ *
+ */
+static void remove_small_list(block_t *block) {
+    block_t *prev = get_mini_prev(block);
+    block_t *next = block->data.miniblock.next;
+
+    if (prev == NULL) {
+        cur_arena->small_block_start = next;
     } else {
-        block->data.miniblock.next = small_block_start;
-        small_block_start = block;
+        prev->data.miniblock.next = next;
+    }
+    if (next != NULL) {
+        set_mini_prev(next, prev);
+    }
+
+    block->data.miniblock.next = NULL;
+    block->header = pack(min_block_size, false, get_prev_alloc(block),
+                         get_prev_small(block));
+    cur_arena->stats.mini_bytes -= min_block_size;
+}
+
+/**
+ * @brief add a specific block to a doubly linked list called
+ * small_block_start.
+ *
+ * @param block
+ *
+ */
+static void add_small_list(block_t *block) {
+    block->data.miniblock.next = cur_arena->small_block_start;
+    set_mini_prev(block, NULL);
+    if (cur_arena->small_block_start != NULL) {
+        set_mini_prev(cur_arena->small_block_start, block);
     }
+    cur_arena->small_block_start = block;
+    cur_arena->stats.mini_bytes += min_block_size;
 }
 
 /*
@@ -747,6 +1590,18 @@ static void add_small_list(block_t *block) {
 
 /******** The remaining content below are helper and debug routines ********/
 
+/**
+ * @brief note that the heap of the current arena may hold data below addr,
+ * so calloc can no longer count on it being zero
+ *
+ * @param[in] addr
+ */
+static void mark_dirty(void *addr) {
+    if ((char *)addr > cur_arena->zero_start) {
+        cur_arena->zero_start = addr;
+    }
+}
+
 /**
  * @brief
  *
@@ -789,6 +1644,9 @@ static block_t *coalesce_block(block_t *block, size_t size) {
     small list or the segment list) and returns the merged block. */
     if (prev_alloc_status == true && next_alloc_status == false) {
         size_t merged_size = get_size(block) + get_size(next_block);
+        cur_arena->stats.coalesces++;
+        // The links of the next block end up inside the merged one
+        mark_dirty((char *)next_block + wsize + sizeof(union Data));
         if (get_size(next_block) == min_block_size) {
             remove_small_list(next_block);
         } else {
@@ -821,6 +1679,7 @@ static block_t *coalesce_block(block_t *block, size_t size) {
     if (prev_alloc_status == false && next_alloc_status == true) {
 
         size_t merged_size = get_size(block) + get_size(prev_block);
+        cur_arena->stats.coalesces++;
         if (is_prev_small) {
             remove_small_list(prev_block);
 
@@ -846,6 +1705,8 @@ static block_t *coalesce_block(block_t *block, size_t size) {
     block to the segment list and returns it. */
     size_t merged_size =
         get_size(block) + get_size(prev_block) + get_size(next_block);
+    cur_arena->stats.coalesces += 2;
+    mark_dirty((char *)next_block + wsize + sizeof(union Data));
     if (is_prev_small) {
         remove_small_list(prev_block);
 
@@ -866,6 +1727,80 @@ static block_t *coalesce_block(block_t *block, size_t size) {
     return prev_block;
 }
 
+/**
+ * @brief acquire the lock guarding mem_sbrk and the chunk table; does nothing
+ * unless MM_THREAD_SAFE is set
+ */
+static void sbrk_lock(void) {
+#if MM_THREAD_SAFE
+    pthread_mutex_lock(&sbrk_mutex);
+#endif
+}
+
+/**
+ * @brief release the lock guarding mem_sbrk and the chunk table
+ */
+static void sbrk_unlock(void) {
+#if MM_THREAD_SAFE
+    pthread_mutex_unlock(&sbrk_mutex);
+#endif
+}
+
+/**
+ * @brief grow the last chunk of the current arena in place, the old epilogue
+ * becomes the header of the new free block
+ * precondition: the sbrk lock is held and the chunk ends the heap
+ *
+ * @param[in] size multiple of dsize
+ * @return the new free block, not yet followed by an epilogue or coalesced
+ */
+static block_t *grow_chunk(size_t size) {
+    void *bp = mem_sbrk((intptr_t)size);
+    if (bp == (void *)-1) {
+        return NULL;
+    }
+
+    // Initialize free block header/footer
+    block_t *block = payload_to_header(bp);
+    write_block(block, size, false, get_prev_alloc(block),
+                get_prev_small(block));
+    return block;
+}
+
+/**
+ * @brief carve a new chunk for the current arena off the end of the heap:
+ * a prologue footer, one free block of at least size bytes and room for the
+ * epilogue. Only happens when several arenas share the heap.
+ * precondition: the sbrk lock is held
+ *
+ * @param[in] size multiple of dsize
+ * @return the new free block, not yet followed by an epilogue
+ */
+static block_t *new_chunk(size_t size) {
+#if MM_THREAD_SAFE
+    size_t count = chunk_count;
+    if (count == ARENA_MAX_CHUNKS) {
+        return NULL;
+    }
+#endif
+    size = max(size, ARENA_CHUNK_SIZE);
+    word_t *start = mem_sbrk((intptr_t)(size + dsize));
+    if (start == (void *)-1) {
+        return NULL;
+    }
+
+    start[0] = pack(0, true, true, false); // Chunk prologue (block footer)
+    block_t *block = (block_t *)&start[1];
+    write_block(block, size, false, true, false);
+
+#if MM_THREAD_SAFE
+    chunks[count].start = (char *)start;
+    chunks[count].arena = cur_arena;
+    __atomic_store_n(&chunk_count, count + 1, __ATOMIC_RELEASE);
+#endif
+    return block;
+}
+
 /**
  * @brief extend the heap by given size
  * precodition: There is no approiate free block to be allocated
@@ -875,33 +1810,122 @@ static block_t *coalesce_block(block_t *block, size_t size) {
  * @return the address of the requested the free block
  */
 static block_t *extend_heap(size_t size) {
-    void *bp;
+    block_t *block;
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
+
+    sbrk_lock();
+    if ((char *)cur_arena->epilogue + wsize == (char *)mem_heap_hi() + 1) {
+        // The last chunk of the arena ends the heap, grow it in place
+        block = grow_chunk(size);
+    } else {
+        // Another arena grew the heap since, start a chunk of our own
+        block = new_chunk(size);
+    }
+    if (block == NULL) {
+        sbrk_unlock();
         return NULL;
     }
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
+    // Create new epilogue header, while it still ends the heap
+    block_t *block_next = find_next(block);
+    write_epilogue(block_next);
+    sbrk_unlock();
+    cur_arena->epilogue = block_next;
+    cur_arena->heap_bytes += get_size(block);
+    cur_arena->stats.sbrks++;
+    // Past its header the new block is memory nobody wrote yet
+    cur_arena->zero_start = (char *)block + wsize;
 
-    if (block == heap_start) {
-        write_block(block, size, false, true, false);
+    // Coalesce in case the previous block was free
+    block = coalesce_block(block, get_size(block));
 
-    } else {
-        write_block(block, size, false, get_prev_alloc(block),
-                    get_prev_small(block));
+    return block;
+}
+
+/**
+ * @brief the most the heap of the current arena grows by ahead of need,
+ * see HEAP_GROWTH_BUDGET
+ *
+ * @return at least chunksize bytes
+ */
+static size_t growth_budget(void) {
+#if HEAP_GROWTH_BUDGET
+    return max(cur_arena->heap_bytes / HEAP_GROWTH_BUDGET, chunksize);
+#else
+    return chunksize;
+#endif
+}
+
+/**
+ * @brief give the end of a free block that ends the heap back to mem_sbrk
+ * once it reaches TRIM_THRESHOLD bytes more than the heap may grow ahead,
+ * keeping that much of it, so the heap does not shrink only to grow again
+ * precondition: the block is free, coalesced and on its list
+ *
+ * @param[in] block
+ */
+static void trim_heap(block_t *block) {
+    size_t size = get_size(block);
+    size_t keep = growth_budget();
+    if (TRIM_THRESHOLD == 0 || size < keep + TRIM_THRESHOLD ||
+        find_next(block) != cur_arena->epilogue) {
+        return;
     }
 
-    // Create new epilogue header
+    sbrk_lock();
+    // Only the chunk at the end of the heap can give memory back
+    if ((char *)cur_arena->epilogue + wsize != (char *)mem_heap_hi() + 1) {
+        sbrk_unlock();
+        return;
+    }
+    keep = round_up(keep, dsize);
+    size_t release = size - keep;
+    if (mem_sbrk(-(intptr_t)release) == (void *)-1) {
+        sbrk_unlock();
+        return;
+    }
+    remove_seg_list(block);
+    write_block(block, keep, false, get_prev_alloc(block),
+                get_prev_small(block));
     block_t *block_next = find_next(block);
     write_epilogue(block_next);
+    sbrk_unlock();
+    cur_arena->epilogue = block_next;
+    cur_arena->heap_bytes -= release;
+    cur_arena->grow_step = chunksize;
+    add_seg_list(block);
+}
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block, size);
+/**
+ * @brief the free block that ends the last chunk of the current arena
+ *
+ * @return the block, NULL if the last block of the chunk is allocated
+ */
+static block_t *find_top(void) {
+    block_t *epilogue = cur_arena->epilogue;
+    if (epilogue == NULL || get_prev_alloc(epilogue)) {
+        return NULL;
+    }
+    return get_prev_small(epilogue) ? find_prev_small(epilogue)
+                                    : find_prev(epilogue);
+}
 
-    return block;
+/**
+ * @brief how far to grow the heap when nothing fits, and double that for
+ * next time; see HEAP_GROWTH_BUDGET
+ *
+ * @return at least chunksize bytes
+ */
+static size_t growth_step(void) {
+    size_t step = cur_arena->grow_step;
+    size_t budget = growth_budget();
+    if (step > budget) {
+        step = budget;
+    }
+    cur_arena->grow_step = 2 * step;
+    return step;
 }
 
 /**
@@ -922,13 +1946,16 @@ static void split_block(block_t *block, size_t asize) {
      * the seglist*/
     if ((block_size - asize) >= min_block_size) {
 
-        block_t *block_next;
+        // The split off block may start on a page nobody touched yet; its
+        // header is stored before write_block reads it, which would fault
+        // the page in once for reading and again for writing
+        bool is_miniblock = asize == min_block_size;
+        block_t *block_next = (block_t *)((char *)block + asize);
+        write_block(block_next, block_size - asize, false, true, is_miniblock);
         write_block(block, asize, true, get_prev_alloc(block),
                     get_prev_small(block));
-        bool is_miniblock = asize == min_block_size;
+        cur_arena->stats.splits++;
 
-        block_next = find_next(block);
-        write_block(block_next, block_size - asize, false, true, is_miniblock);
         /* if the splited block is the mini block, add the splited block in to
          * small_block_start list, otherwise add it to seglist*/
         if ((block_size - asize) == min_block_size) {
@@ -941,524 +1968,2845 @@ static void split_block(block_t *block, size_t asize) {
     dbg_ensures(get_alloc(block));
 }
 
+#if PLACEMENT == PLACE_GOOD_FIT
+/**
+ * @brief learn from a search of a list bucket how deep the next ones go.
+ * A search votes to go deeper if it ran out of depth with blocks left and
+ * found nothing, or found its best block in the second half with slack to
+ * spare; it votes to go shallower if the best block was in the first half
+ * of the blocks it looked at, so that the rest of the probes bought nothing.
+ * SEARCH_VOTES net votes double the depth or take a quarter off it.
+ *
+ * @param[in] i index of the bucket in the seglist
+ * @param[in] probes blocks the search looked at
+ * @param[in] best position of the block chosen, counting from 1, 0 if none
+ * @param[in] slack bytes the chosen block has beyond the request
+ * @param[in] cut whether blocks were left when the search ran out of depth
+ */
+static void tune_depth(size_t i, size_t probes, size_t best, size_t slack,
+                       bool cut) {
+    size_t depth = cur_arena->search_depth[i];
+    int *votes = &cur_arena->search_votes[i];
+    cur_arena->searched[i] = true;
+    if (best != 0 && 2 * best <= probes) {
+        (*votes)--;
+    } else if (cut && (best == 0 || slack > 0)) {
+        (*votes)++;
+    }
+
+    if (*votes >= SEARCH_VOTES) {
+        cur_arena->search_depth[i] = depth * 2 < SEARCH_BUDGET ? depth * 2
+                                                               : SEARCH_BUDGET;
+        *votes = 0;
+    } else if (*votes <= -SEARCH_VOTES) {
+        cur_arena->search_depth[i] = depth > 1 ? depth - (depth + 3) / 4 : 1;
+        *votes = 0;
+    }
+}
+#endif
+
 /**
- * @brief find first fit free block thank can be allocated
- * precondition: allocating a memory
- * postition: find the approiated free block
+ * @brief search a bucket for a block that holds asize bytes from the first
+ * payload address in it that is a multiple of align, choosing among the
+ * blocks that fit as PLACEMENT says
+ * precondition: i is a list bucket, not the tree; asize and align are
+ * multiples of dsize, align a power of 2
  *
+ * @param[in] i index of the bucket in the seglist
  * @param[in] asize
- * @return the address of the block
+ * @param[in] align dsize if any payload address will do
+ * @return the block, NULL if none of the candidates fits
  */
-static block_t *find_fit(size_t asize) {
+static block_t *bucket_fit(size_t i, size_t asize, size_t align) {
     block_t *selected = NULL;
-    block_t *block = NULL;
-    block_t *current_head;
-    /*find fit block from seglist based on the size of block*/
-    for (size_t i = search_seg_by_size(asize); i < BUCKET_SIZE; i++) {
-        /*get the head of specific size in seglist*/
-        current_head = seglist[i];
-        size_t count = 0;
-        /* linear search in the list but only search top 10 element, and get the
-         * minimum size of block that meet the requirment, which improve
-         * throughtput*/
-        for (block = current_head; block != NULL && count < SEARCH_LIMIT;
-             block = *get_next(block)) {
-
-            if (!(get_alloc(block)) && (asize <= get_size(block))) {
-                if (selected == NULL) {
-                    selected = block;
-                } else {
-                    if (get_size(block) < get_size(selected)) {
-                        selected = block;
-                    }
-                }
-            }
-            count++;
-        }
-        if (selected != NULL) {
+    size_t count = 0;
+#if PLACEMENT == PLACE_NEXT_FIT
+    block_t *start = cur_arena->rover[i];
+    if (start == NULL) {
+        start = cur_arena->seglist[i];
+    }
+    /* go round the list once from the rover, wrapping at its end */
+    block_t *block = start;
+    do {
+        count++;
+        size_t gap = -(size_t)header_to_payload(block) & (align - 1);
+        if (get_size(block) >= gap + asize) {
+            selected = block;
+            cur_arena->rover[i] = block;
             break;
         }
+        block = *get_next(block);
+        if (block == NULL) {
+            block = cur_arena->seglist[i];
+        }
+    } while (block != start);
+#else
+#if PLACEMENT == PLACE_GOOD_FIT
+    size_t depth = cur_arena->search_depth[i];
+#else
+    size_t depth = SEARCH_LIMIT;
+#endif
+    size_t best = 0;
+    size_t slack = 0;
+    block_t *block;
+    for (block = cur_arena->seglist[i]; block != NULL && count < depth;
+         block = *get_next(block)) {
+        count++;
+        // The slack in front of the aligned payload becomes a free block
+        size_t gap = -(size_t)header_to_payload(block) & (align - 1);
+        size_t size = get_size(block);
+        if (size >= gap + asize &&
+            (selected == NULL || size < get_size(selected))) {
+            selected = block;
+            best = count;
+            slack = size - gap - asize;
+            /* nothing after an exact fit can do better */
+            if (PLACEMENT == PLACE_FIRST_FIT || slack == 0) {
+                break;
+            }
+        }
     }
-    return selected; // no fit found
+#if PLACEMENT == PLACE_GOOD_FIT
+    tune_depth(i, count, best, slack, block != NULL && count == depth);
+#else
+    (void)best;
+#endif
+#endif
+    cur_arena->stats.fit_probes += count;
+    return selected;
 }
 
 /**
- * @brief  function checks if the initial and final blocks of the heap are
- * correctly formatted.
+ * @brief find a free block that can hold asize bytes, in the lowest
+ * non-empty bucket that has one
+ * precondition: asize is a multiple of dsize
  *
- * @return a boolean value.
+ * @param[in] asize
+ * @return the address of the block, NULL if nothing fits
  */
-static bool mm_check_epi_pro_logue(void) {
-    word_t *initial_heap = mem_heap_lo();
-    if (extract_size(*initial_heap) != 0 ||
-        extract_alloc(*initial_heap) == false) {
-        return false;
-    }
-
-    word_t *epilogue = (word_t *)((char *)mem_heap_hi() - 7);
-
-    if (extract_size(*epilogue) != 0 || extract_alloc(*epilogue) == false) {
-        return false;
+static block_t *find_fit(size_t asize) {
+    cur_arena->stats.fit_searches++;
+    /* only the non-empty buckets at or above the starting bucket are worth
+     * visiting, the lowest of them is found with a single bit scan */
+    word_t candidates =
+        cur_arena->seglist_bitmap & (~(word_t)0 << get_bucket(asize));
+    while (candidates != 0) {
+        size_t i = (size_t)__builtin_ctzl((unsigned long)candidates);
+        candidates &= candidates - 1;
+        /* the large blocks are searched for a true best fit */
+        if (i == TREE_BUCKET) {
+            return tree_best_fit(cur_arena->seglist[TREE_BUCKET], asize);
+        }
+        block_t *selected = bucket_fit(i, asize, dsize);
+        if (selected != NULL) {
+            return selected;
+        }
     }
-    return true;
+    return NULL; // no fit found
 }
 
 /**
- * @brief The function checks if the memory blocks in the heap are aligned on a
- * 16-byte boundary.
+ * @brief find a free block that holds asize bytes from the first payload
+ * address in it that is a multiple of align, chosen in each bucket as in
+ * find_fit. A block that happens to be aligned already fits with no slack
+ * at all; only the large blocks of the tree are searched with room for the
+ * worst case.
+ * precondition: asize and align are multiples of dsize, align a power of 2
  *
- * @return The function `mm_check_alignment` returns a boolean value.
+ * @param[in] asize
+ * @param[in] align
+ * @return the block, NULL if none of the candidates fits
  */
-static bool mm_check_alignment(void) {
-    block_t *current;
-    for (current = heap_start; get_size(current) > 0;
-         current = find_next(current)) {
-        char *bp = header_to_payload(current);
-
-        if (((word_t)bp % (word_t)16) != 0) {
-            return false;
+static block_t *find_aligned_fit(size_t asize, size_t align) {
+    cur_arena->stats.fit_searches++;
+    word_t candidates =
+        cur_arena->seglist_bitmap & (~(word_t)0 << get_bucket(asize));
+    while (candidates != 0) {
+        size_t i = (size_t)__builtin_ctzl((unsigned long)candidates);
+        candidates &= candidates - 1;
+        if (i == TREE_BUCKET) {
+            return tree_best_fit(cur_arena->seglist[TREE_BUCKET],
+                                 asize + align - dsize);
+        }
+        block_t *selected = bucket_fit(i, asize, align);
+        if (selected != NULL) {
+            return selected;
         }
     }
-    return true;
+    return NULL;
 }
 
 /**
- * @brief function checks if coalescing is correctly implemented in the memory
- * management system.
+ * @brief mark an allocated block free and coalesce it with its neighbors
+ * precondition: the block is allocated
+ * postcondition: the block is merged into the free lists
  *
- * @return a boolean value. If all the conditions in the function are satisfied,
- * it will return true. Otherwise, it will return false.
+ * @param[in] block
  */
-static bool mm_check_coalescing(void) {
-    block_t *current;
-    for (current = heap_start; get_size(current) > 0;
-         current = find_next(current)) {
+static void free_block(block_t *block) {
+    size_t size = get_size(block);
 
-        if (get_alloc(current) == false) {
-            if (current == heap_start) {
-                if (get_alloc(find_next(current)) == false) {
-                    return false;
-                }
-            }
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
 
-            if (get_prev_alloc(current) == false ||
-                get_alloc(find_next(current)) == false) {
-                return false;
-            }
+    write_block(block, size, false, get_prev_alloc(block),
+                get_prev_small(block));
+
+    // Try to coalesce the block with its neighbors, a large free block at
+    // the end of the heap then goes back to mem_sbrk
+    trim_heap(coalesce_block(block, size));
+}
+
+/**
+ * @brief coalesce every block parked on the quick lists of the current arena
+ */
+static void quick_flush(void) {
+    for (size_t bin = 0; bin < QUICK_BINS; bin++) {
+        while (cur_arena->quick[bin] != NULL) {
+            block_t *block = cur_arena->quick[bin];
+            cur_arena->quick[bin] = block->data.miniblock.next;
+            free_block(block);
         }
     }
-    return true;
+    cur_arena->quick_bytes = 0;
 }
 
 /**
- * @brief  function `mm_check_boundaries` checks if the boundaries of the heap
- * are within the expected range.
+ * @brief park a freed block on the quick list of its size instead of
+ * coalescing it, if coalescing is deferred; parking past QUICK_MAX_BYTES
+ * coalesces all parked blocks
+ * precondition: the lock of the block's arena is held
  *
- * @return a boolean value.
+ * @param[in] block an allocated block
+ * @return false if the block has to be freed right away
  */
-static bool mm_check_boundaries(void) {
-    char *initial_heap = (char *)mem_heap_lo() + 8;
-    char *epilogue = ((char *)mem_heap_hi() - 7);
-    block_t *current;
-    for (current = heap_start; get_size(current) > 0;
-         current = find_next(current)) {
-        char *bp = (char *)current;
-
-        if ((word_t)bp < (word_t)initial_heap ||
-            (word_t)current > (word_t)epilogue) {
-            return false;
-        }
+static bool quick_put(block_t *block) {
+    size_t size = get_size(block);
+    if (!defer_coalescing || size > QUICK_MAX_SIZE) {
+        return false;
+    }
+    size_t bin = size / dsize - 1;
+    block->data.miniblock.next = cur_arena->quick[bin];
+    cur_arena->quick[bin] = block;
+    cur_arena->quick_bytes += size;
+    if (cur_arena->quick_bytes > QUICK_MAX_BYTES) {
+        quick_flush();
     }
     return true;
 }
 
 /**
- * @brief The function `mm_check_header_footer` checks if the headers and
- * footers of all blocks in the heap are consistent.
+ * @brief take a parked block of exactly asize bytes back
  *
- * @return a boolean value. If all the header and footer pairs in the heap are
- * valid, the function will return true. Otherwise, it will return false.
+ * @param[in] asize
+ * @return the block, still marked allocated, or NULL if none is parked
  */
-static bool mm_check_header_footer(void) {
-
-    for (block_t *current = heap_start; get_size(current) > 0;
-         current = find_next(current)) {
-        if (!get_alloc(current)) {
-            size_t size = get_size(current);
-            if (size < min_block_size) {
-                return false;
-            }
-
-            word_t *footer = header_to_footer(current);
-            bool result = get_alloc(current) == extract_alloc(*footer);
-
-            if (!result) {
-                return false;
-            }
-        }
+static block_t *quick_get(size_t asize) {
+    if (asize > QUICK_MAX_SIZE) {
+        return NULL;
     }
-    return true;
+    size_t bin = asize / dsize - 1;
+    block_t *block = cur_arena->quick[bin];
+    if (block != NULL) {
+        cur_arena->quick[bin] = block->data.miniblock.next;
+        cur_arena->quick_bytes -= asize;
+        // It is a new block to its owner, not one realloc has moved
+        block->header &= ~realloc_mask;
+    }
+    return block;
 }
 
 /**
- * @brief function `mm_check_prev_next` checks if the previous and next pointers
- * of each block in the `seglist` are correctly set.
+ * @brief find a free block of at least asize bytes, extending the heap if
+ * nothing fits
+ * precondition: asize is a multiple of dsize and at least min_block_size
+ * postcondition: the block is still free and on its list
  *
- * @return a boolean value. If all the previous and next pointers in the seglist
- * are correctly linked, the function will return true. Otherwise, it will
- * return false.
+ * @param[in] asize
+ * @return the free block, NULL if the heap can not grow
+ */
+static block_t *take_block(size_t asize) {
+    block_t *block;
+
+    if (asize == min_block_size && cur_arena->small_block_start != NULL) {
+
+        block = cur_arena->small_block_start;
+
+    } else {
+        // Search the free list for a fit
+        block = find_fit(asize);
+    }
+
+    // Coalescing the parked blocks may make one that fits
+    if (block == NULL && cur_arena->quick_bytes != 0) {
+        quick_flush();
+        block = find_fit(asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        // A free block ending the heap only needs to grow by what it lacks
+        block_t *top = find_top();
+        size_t have = top != NULL ? get_size(top) : 0;
+        size_t lack = have < asize ? asize - have : 0;
+        block = extend_heap(max(lack, growth_step()));
+        // Another arena may have grown the heap in between, then the new
+        // memory starts a chunk of its own instead of merging with the top
+        if (block != NULL && get_size(block) < asize) {
+            block = extend_heap(asize);
+        }
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    return block;
+}
+
+/**
+ * @brief mark a free block allocated, giving back what it has beyond asize
+ * precondition: the block is free and at least asize bytes
+ * postcondition: the block is allocated and split to asize if possible
+ *
+ * @param[in] block
+ * @param[in] asize
+ */
+static void place_block(block_t *block, size_t asize) {
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Take the block off its free list while its header still holds the
+    // list information
+    size_t block_size = get_size(block);
+    if (block_size == min_block_size) {
+        remove_small_list(block);
+    } else {
+        remove_seg_list(block);
+    }
+
+    // Mark block as allocated
+    write_block(block, block_size, true, get_prev_alloc(block),
+                get_prev_small(block));
+
+    // Try to split the block if too large
+    split_block(block, asize);
+
+    // The payload is the caller's now, whatever it writes there
+    mark_dirty((char *)find_next(block) + wsize);
+}
+
+/**
+ * @brief take a block of at least asize bytes from the free lists, extending
+ * the heap if nothing fits, and mark it allocated
+ * precondition: asize is a multiple of dsize and at least min_block_size
+ * postcondition: the block is allocated and split to asize if possible
+ *
+ * @param[in] asize
+ * @return the allocated block, NULL if the heap can not grow
+ */
+static block_t *alloc_block(size_t asize) {
+    block_t *block = take_block(asize);
+    if (block != NULL) {
+        place_block(block, asize);
+    }
+    return block;
+}
+
+/**
+ * @brief cut a free block into as many allocated blocks of asize bytes as
+ * it holds, up to n, in one pass; the blocks inside the run only get a
+ * header, as the next block's prev bits are written along with its header
+ * precondition: the block is free and at least asize bytes
+ * postcondition: what is left after the last block is free and on its list
+ *
+ * @param[in] block
+ * @param[in] asize
+ * @param[in] n at least 1
+ * @param[out] out the payloads, in address order
+ * @return the number of blocks, at least 1
+ */
+static size_t carve_block(block_t *block, size_t asize, size_t n,
+                          void **out) {
+    dbg_assert(!get_alloc(block));
+
+    size_t block_size = get_size(block);
+    if (block_size == min_block_size) {
+        remove_small_list(block);
+    } else {
+        remove_seg_list(block);
+    }
+
+    size_t count = block_size / asize < n ? block_size / asize : n;
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_small = get_prev_small(block);
+    for (size_t i = 0; i + 1 < count; i++) {
+        block->header = pack(asize, true, prev_alloc, prev_small);
+        out[i] = header_to_payload(block);
+        prev_alloc = true;
+        prev_small = asize == min_block_size;
+        block = (block_t *)((char *)block + asize);
+    }
+
+    // The last block takes the rest, and gives back what it does not need
+    write_block(block, block_size - (count - 1) * asize, true, prev_alloc,
+                prev_small);
+    split_block(block, asize);
+    out[count - 1] = header_to_payload(block);
+
+    mark_dirty((char *)find_next(block) + wsize);
+    return count;
+}
+
+/**
+ * @brief sort pointers by address by insertion, as far as that is cheap; the
+ * pointers of a batch are often sorted already, or nearly, and then it takes
+ * about one comparison each. Once SORT_MAX_MOVES moves per pointer are used
+ * up, the rest is left in the order it came in.
+ *
+ * @param[in,out] ptrs
+ * @param[in] n
+ */
+static void sort_addresses(void **ptrs, size_t n) {
+    size_t moves = n * SORT_MAX_MOVES;
+    for (size_t i = 1; i < n; i++) {
+        void *p = ptrs[i];
+        size_t j = i;
+        while (j > 0 && (uintptr_t)ptrs[j - 1] > (uintptr_t)p) {
+            if (moves-- == 0) {
+                ptrs[j] = p;
+                return;
+            }
+            ptrs[j] = ptrs[j - 1];
+            j--;
+        }
+        ptrs[j] = p;
+    }
+}
+
+/**
+ * @brief how many leading payload bytes of a free block calloc has to clear;
+ * the rest of the block is untouched memory from mem_sbrk, but for the
+ * footer, which calloc clears by itself
+ *
+ * @param[in] block a free block of the current arena
+ * @return the number of bytes, may be more than the block holds
+ */
+static size_t dirty_prefix(block_t *block) {
+    char *payload = header_to_payload(block);
+#if FRESH_HEAP_ZERO
+    char *clean = cur_arena->zero_start;
+    // The top block's list links are not covered by zero_start
+    if (clean < payload + sizeof(union Data)) {
+        clean = payload + sizeof(union Data);
+    }
+    return (size_t)(clean - payload);
+#else
+    return get_size(block);
+#endif
+}
+
+/**
+ * @brief shrink an allocated block to asize bytes in place; the cut off tail
+ * is freed and merges with a free right neighbour
+ * precondition: the block is allocated and at least asize bytes
+ * postcondition: the block is allocated and less than asize + min_block_size
+ *
+ * @param[in] block
+ * @param[in] asize
+ */
+static void shrink_block(block_t *block, size_t asize) {
+    size_t block_size = get_size(block);
+    if (block_size - asize < min_block_size) {
+        return;
+    }
+
+    write_block(block, asize, true, get_prev_alloc(block),
+                get_prev_small(block));
+    block_t *tail = find_next(block);
+    write_block(tail, block_size - asize, true, true,
+                asize == min_block_size);
+    cur_arena->stats.splits++;
+    free_block(tail);
+}
+
+/**
+ * @brief take an allocated block of asize bytes whose payload starts at a
+ * multiple of align; the free memory in front of and behind it goes back to
+ * the lists.
+ * When nothing fits, the heap grows just enough for the block to end it.
+ * precondition: asize and align are multiples of dsize, align a power of 2
+ *
+ * @param[in] asize
+ * @param[in] align
+ * @return the allocated block, NULL if the heap can not grow
+ */
+static block_t *alloc_aligned_block(size_t asize, size_t align) {
+    block_t *block = find_aligned_fit(asize, align);
+    if (block == NULL && cur_arena->quick_bytes != 0) {
+        quick_flush();
+        block = find_aligned_fit(asize, align);
+    }
+    if (block == NULL && cur_arena->epilogue != NULL) {
+        block_t *top = find_top();
+        size_t start = (size_t)(top != NULL ? top : cur_arena->epilogue);
+        size_t end = round_up(start + wsize, align) - wsize + asize;
+        size_t have = (size_t)cur_arena->epilogue;
+        block = end <= have ? top : extend_heap(end - have);
+        // Another arena may have grown the heap, the block then starts a
+        // new chunk with room for any alignment
+        if (block != NULL &&
+            round_up((size_t)block + wsize, align) - wsize + asize >
+                (size_t)block + get_size(block)) {
+            block = NULL;
+        }
+    }
+    if (block == NULL) {
+        block = extend_heap(asize + align);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    place_block(block, get_size(block));
+
+    size_t gap = -(size_t)header_to_payload(block) & (align - 1);
+    if (gap != 0) {
+        size_t size = get_size(block);
+        write_block(block, gap, true, get_prev_alloc(block),
+                    get_prev_small(block));
+        block_t *aligned = find_next(block);
+        write_block(aligned, size - gap, true, true, gap == min_block_size);
+        free_block(block);
+        block = aligned;
+    }
+    shrink_block(block, asize);
+    return block;
+}
+
+/**
+ * @brief whether a growing realloc already had to move the block; read
+ * atomically like get_owned_size, as the owner may not hold the lock
+ *
+ * @param[in] block an allocated block
+ */
+static bool get_realloc_grown(block_t *block) {
+    return (__atomic_load_n(&block->header, __ATOMIC_RELAXED) & realloc_mask) !=
+           0;
+}
+
+/**
+ * @brief mark an allocated block as moved by a growing realloc
+ * precondition: the lock of the block's arena is held
+ *
+ * @param[in] block an allocated block
+ */
+static void set_realloc_grown(block_t *block) {
+    block->header |= realloc_mask;
+}
+
+/**
+ * @brief count a realloc that moved its block, for mm_stats
+ *
+ * @param[in] bytes the number of bytes copied
+ */
+static void count_realloc_copy(size_t bytes) {
+    __atomic_fetch_add(&realloc_copies, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&realloc_copy_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief grow an allocated block to asize bytes in place by absorbing a free
+ * right neighbour, extending the heap first when the block (or its free
+ * neighbour) is the last one before the end of the heap
+ * precondition: the block is allocated and smaller than asize
+ *
+ * @param[in] block
+ * @param[in] asize
+ * @return true if the block now holds asize bytes, false if it is unchanged
+ */
+static bool grow_block(block_t *block, size_t asize) {
+    size_t block_size = get_size(block);
+    block_t *next = find_next(block);
+    size_t avail = get_alloc(next) ? block_size : block_size + get_size(next);
+
+    if (avail < asize) {
+        block_t *last = get_alloc(next) ? next : find_next(next);
+        if (last != cur_arena->epilogue) {
+            return false;
+        }
+        // extend_heap merges the new memory into a free neighbour, unless
+        // another arena grew the heap in between and it starts a new chunk
+        if (extend_heap(max(asize - avail, growth_step())) == NULL) {
+            return false;
+        }
+        next = find_next(block);
+        if (get_alloc(next) || block_size + get_size(next) < asize) {
+            return false;
+        }
+        avail = block_size + get_size(next);
+    }
+
+    if (get_size(next) == min_block_size) {
+        remove_small_list(next);
+    } else {
+        remove_seg_list(next);
+    }
+    bool grown = get_realloc_grown(block);
+    write_block(block, avail, true, get_prev_alloc(block),
+                get_prev_small(block));
+    shrink_block(block, asize);
+    if (grown) {
+        set_realloc_grown(block);
+    }
+    mark_dirty((char *)find_next(block) + wsize);
+    return true;
+}
+
+/**
+ * @brief acquire the lock of an arena and make it the one the free list
+ * functions work on; does nothing unless MM_THREAD_SAFE is set
+ *
+ * @param[in] arena
+ */
+static void arena_lock(arena_t *arena) {
+#if MM_THREAD_SAFE
+    pthread_mutex_lock(&arena->lock);
+    cur_arena = arena;
+#endif
+}
+
+/**
+ * @brief release the lock of the current arena
+ */
+static void arena_unlock(void) {
+#if MM_THREAD_SAFE
+    pthread_mutex_unlock(&cur_arena->lock);
+#endif
+}
+
+/**
+ * @brief take the lock of every arena, in order; no other path holds two
+ * arena locks at once, so this cannot deadlock
+ */
+static void arena_lock_all(void) {
+#if MM_THREAD_SAFE
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        pthread_mutex_lock(&arenas[a].lock);
+    }
+#endif
+}
+
+/**
+ * @brief release the locks taken by arena_lock_all
+ */
+static void arena_unlock_all(void) {
+#if MM_THREAD_SAFE
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+#endif
+}
+
+/**
+ * @brief the arena the calling thread allocates from; threads are bound to
+ * the arenas round-robin on their first allocation
+ *
+ * @return the arena of the calling thread
+ */
+static arena_t *get_thread_arena(void) {
+#if MM_THREAD_SAFE
+    if (thread_arena == NULL) {
+        unsigned int n = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[n % MM_ARENAS];
+    }
+    return thread_arena;
+#else
+    return &arenas[0];
+#endif
+}
+
+/**
+ * @brief find the arena owning a block, so that a block freed by another
+ * thread goes back to the free lists it came from. The owner is the arena of
+ * the last chunk starting before the block.
+ *
+ * @param[in] block
+ * @return the arena owning the block
+ */
+static arena_t *arena_of(block_t *block) {
+#if MM_THREAD_SAFE && MM_ARENAS > 1
+    size_t lo = 0;
+    size_t hi = __atomic_load_n(&chunk_count, __ATOMIC_ACQUIRE);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunks[mid].start < (char *)block) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return chunks[lo].arena;
+#else
+    return &arenas[0];
+#endif
+}
+
+#if MM_THREAD_SAFE
+/**
+ * @brief initialize the lock of every arena
+ */
+static void arena_init_locks(void) {
+    for (size_t i = 0; i < MM_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+}
+#endif
+
+/**
+ * @brief initialize the heap on the first allocation
+ *
+ * @return false if the heap could not be initialized
+ */
+static bool heap_ready(void) {
+#if MM_THREAD_SAFE
+    if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) != NULL) {
+        return true;
+    }
+    pthread_mutex_lock(&init_mutex);
+    bool ready = heap_start != NULL || mm_init();
+    pthread_mutex_unlock(&init_mutex);
+    return ready;
+#else
+    return heap_start != NULL || mm_init();
+#endif
+}
+
+#if MM_THREAD_SAFE
+/**
+ * @brief return up to n blocks of a bin to the arenas owning them, holding
+ * each lock across a run of blocks from the same arena
+ * precondition: no arena lock is held
+ *
+ * @param[in] cache
+ * @param[in] bin
+ * @param[in] n
+ */
+static void tcache_flush(tcache_t *cache, size_t bin, size_t n) {
+    arena_t *locked = NULL;
+    while (n-- > 0 && cache->bins[bin] != NULL) {
+        block_t *block = cache->bins[bin];
+        cache->bins[bin] = block->data.miniblock.next;
+        cache->count[bin]--;
+
+        arena_t *owner = arena_of(block);
+        if (owner != locked) {
+            if (locked != NULL) {
+                arena_unlock();
+            }
+            arena_lock(owner);
+            locked = owner;
+        }
+        free_block(block);
+    }
+    if (locked != NULL) {
+        arena_unlock();
+    }
+}
+
+/**
+ * @brief pthread key destructor, hands an exiting thread's cache back to the
+ * heap so its blocks are not lost
+ *
+ * @param[in] arg the exiting thread's tcache_t
+ */
+static void tcache_release(void *arg) {
+    tcache_t *cache = arg;
+    if (cache->generation == heap_generation) {
+        for (size_t i = 0; i < TCACHE_BINS; i++) {
+            tcache_flush(cache, i, cache->count[i]);
+        }
+    }
+}
+
+/**
+ * @brief create the key used to find the cache of an exiting thread
+ */
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/**
+ * @brief make the calling thread's cache usable: drop blocks left over from
+ * a heap that mm_init has since discarded, and register the exit hook
+ */
+static void tcache_prepare(void) {
+    if (tcache.generation != heap_generation) {
+        memset(&tcache, 0, sizeof(tcache));
+        tcache.generation = heap_generation;
+    }
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+}
+
+/**
+ * @brief pop a block of exactly asize bytes from the calling thread's cache
+ *
+ * @param[in] asize adjusted size, at most TCACHE_MAX_SIZE
+ * @return the block, still marked allocated, or NULL on a cache miss
+ */
+static block_t *tcache_get(size_t asize) {
+    size_t bin = asize / dsize - 1;
+    tcache_prepare();
+    block_t *block = tcache.bins[bin];
+    if (block != NULL) {
+        tcache.bins[bin] = block->data.miniblock.next;
+        tcache.count[bin]--;
+        // It is a new block to its owner, not one realloc has moved
+        block->header &= ~realloc_mask;
+    }
+    return block;
+}
+
+/**
+ * @brief refill the calling thread's bin for asize after a miss, so that the
+ * next few requests of that size do not take the lock
+ * precondition: the lock of the thread's arena is held
+ *
+ * @param[in] asize adjusted size, at most TCACHE_MAX_SIZE
+ */
+static void tcache_fill(size_t asize) {
+    size_t bin = asize / dsize - 1;
+    tcache_prepare();
+    while (tcache.count[bin] < TCACHE_BATCH) {
+        block_t *block = alloc_block(asize);
+        if (block == NULL) {
+            return;
+        }
+        block->data.miniblock.next = tcache.bins[bin];
+        tcache.bins[bin] = block;
+        tcache.count[bin]++;
+    }
+}
+
+/**
+ * @brief keep a freed block in the calling thread's cache; a full bin first
+ * hands TCACHE_BATCH blocks back to their arenas
+ *
+ * @param[in] block an allocated block
+ * @return false if the block is too large to be cached
+ */
+static bool tcache_put(block_t *block) {
+    size_t size = get_owned_size(block);
+    if (size > TCACHE_MAX_SIZE) {
+        return false;
+    }
+    size_t bin = size / dsize - 1;
+    tcache_prepare();
+    if (tcache.count[bin] >= TCACHE_DEPTH) {
+        tcache_flush(&tcache, bin, TCACHE_BATCH);
+    }
+    block->data.miniblock.next = tcache.bins[bin];
+    tcache.bins[bin] = block;
+    tcache.count[bin]++;
+    return true;
+}
+#endif
+
+/**
+ * @brief whether an allocated block lives in a region from mem_map; its
+ * header has size 0, which in the heap only the epilogue has
+ *
+ * @param[in] block an allocated block
+ */
+static bool is_mapped(block_t *block) {
+    return get_owned_size(block) == 0;
+}
+
+/**
+ * @brief the size of the region holding a mapped block
+ *
+ * @param[in] block a mapped block
+ */
+static size_t get_region_size(block_t *block) {
+    return *((word_t *)block - 1);
+}
+
+/**
+ * @brief map a region for a block of size payload bytes. The region starts
+ * with its size, followed by the block header, which keeps the payload
+ * aligned to dsize
+ *
+ * @param[in] size payload bytes
+ * @return the payload of the mapped block, NULL if mem_map fails
+ */
+static void *map_block(size_t size) {
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size_t rsize = round_up(size + 2 * wsize, mem_pagesize());
+    sbrk_lock();
+    word_t *region = mem_map(rsize);
+    if (region == (void *)-1) {
+        sbrk_unlock();
+        return NULL;
+    }
+    mapped_bytes += rsize;
+    sbrk_unlock();
+    region[0] = rsize;
+    region[1] = pack(0, true, true, false);
+    return region + 2;
+}
+
+/**
+ * @brief hand the region of a mapped block back
+ *
+ * @param[in] block a mapped block
+ */
+static void unmap_block(block_t *block) {
+    size_t rsize = get_region_size(block);
+    sbrk_lock();
+    mem_unmap((word_t *)block - 1, rsize);
+    mapped_bytes -= rsize;
+    sbrk_unlock();
+}
+
+/**
+ * @brief index of the SLAB_RUN_SIZE bytes holding addr in slab_pages
+ *
+ * @param[in] addr an address in the heap
+ */
+static size_t slab_page(const void *addr) {
+    return (size_t)addr / SLAB_RUN_SIZE - (size_t)heap_start / SLAB_RUN_SIZE;
+}
+
+/**
+ * @brief the slab run a pointer returned by malloc lies in; read without a
+ * lock, the bit of a run does not change while the run has objects in use
+ *
+ * @param[in] bp
+ * @return the run, NULL if bp is the payload of an ordinary block
+ */
+static slab_t *slab_of(void *bp) {
+    if (SLAB_MAX_SIZE == 0) {
+        return NULL;
+    }
+    size_t page = slab_page(bp);
+    if (page >= SLAB_SPAN / SLAB_RUN_SIZE) {
+        return NULL;
+    }
+    word_t bits = __atomic_load_n(&slab_pages[page / 64], __ATOMIC_RELAXED);
+    if (((bits >> (page % 64)) & 1) == 0) {
+        return NULL;
+    }
+    return (slab_t *)((size_t)bp & ~(size_t)(SLAB_RUN_SIZE - 1));
+}
+
+/**
+ * @brief number of objects a run of the given object size holds
+ *
+ * @param[in] size
+ */
+static size_t slab_capacity(size_t size) {
+    return (SLAB_RUN_SIZE - wsize - sizeof(slab_t)) / size;
+}
+
+/**
+ * @brief put a run on the current arena's list for its object size
+ *
+ * @param[in] run a run with a free object
+ */
+static void slab_link(slab_t *run) {
+    slab_t **head = &cur_arena->slabs[run->size / dsize - 1];
+    run->prev = NULL;
+    run->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = run;
+    }
+    *head = run;
+}
+
+/**
+ * @brief take a run off the current arena's list for its object size
+ *
+ * @param[in] run a run on its list
+ */
+static void slab_unlink(slab_t *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        cur_arena->slabs[run->size / dsize - 1] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+/**
+ * @brief carve a run for objects of the given size out of the current arena
+ *
+ * @param[in] size object size
+ * @return the run, all objects free, NULL if the heap can not grow or the
+ * run would lie beyond SLAB_SPAN
+ */
+static slab_t *slab_new_run(size_t size) {
+    block_t *block = alloc_aligned_block(SLAB_RUN_SIZE, SLAB_RUN_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+    slab_t *run = header_to_payload(block);
+    size_t page = slab_page(run);
+    if (page >= SLAB_SPAN / SLAB_RUN_SIZE) {
+        free_block(block);
+        return NULL;
+    }
+
+    run->arena = cur_arena;
+    run->size = (uint32_t)size;
+    run->free = (uint32_t)slab_capacity(size);
+    cur_arena->stats.slab_free_bytes += run->free * size;
+    for (size_t i = 0; i < SLAB_MAP_WORDS; i++) {
+        size_t left = run->free > i * 64 ? run->free - i * 64 : 0;
+        run->free_map[i] = left >= 64 ? ~(word_t)0 : ((word_t)1 << left) - 1;
+    }
+    slab_link(run);
+    __atomic_fetch_or(&slab_pages[page / 64], (word_t)1 << (page % 64),
+                      __ATOMIC_RELAXED);
+    return run;
+}
+
+/**
+ * @brief allocate an object from the current arena's slab runs
+ * precondition: the lock of the current arena is held
+ *
+ * @param[in] size object size, a multiple of dsize up to SLAB_MAX_SIZE
+ * @return the object, NULL if the size has no run yet or none could be made,
+ * which leaves the request to the seglist
+ */
+static void *slab_alloc(size_t size) {
+    slab_t *run = cur_arena->slabs[size / dsize - 1];
+    if (run == NULL) {
+        // A run is only worth it once the heap is large and the size common
+        size_t *waits = &cur_arena->slab_waits[size / dsize - 1];
+        if (*waits < SLAB_WARMUP) {
+            (*waits)++;
+            return NULL;
+        }
+        if (cur_arena->heap_bytes < SLAB_MIN_HEAP) {
+            return NULL;
+        }
+        run = slab_new_run(size);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t i = 0;
+    while (run->free_map[i] == 0) {
+        i++;
+    }
+    size_t index = i * 64 + (size_t)__builtin_ctzl(run->free_map[i]);
+    run->free_map[i] &= run->free_map[i] - 1;
+    cur_arena->stats.slab_free_bytes -= size;
+    if (--run->free == 0) {
+        slab_unlink(run);
+    }
+    return (char *)run + sizeof(slab_t) + index * size;
+}
+
+/**
+ * @brief give an object back to its run; a run left empty goes back to the
+ * heap, where it coalesces like any other block
+ * precondition: the lock of the run's arena is held
+ *
+ * @param[in] run
+ * @param[in] bp an object of the run in use
+ */
+static void slab_free(slab_t *run, void *bp) {
+    size_t index =
+        ((size_t)((char *)bp - (char *)run) - sizeof(slab_t)) / run->size;
+    word_t bit = (word_t)1 << (index % 64);
+    dbg_assert((run->free_map[index / 64] & bit) == 0);
+    run->free_map[index / 64] |= bit;
+    cur_arena->stats.slab_free_bytes += run->size;
+
+    if (run->free++ == 0) {
+        slab_link(run);
+    } else if (run->free == slab_capacity(run->size)) {
+        slab_unlink(run);
+        size_t page = slab_page(run);
+        __atomic_fetch_and(&slab_pages[page / 64],
+                           ~((word_t)1 << (page % 64)), __ATOMIC_RELAXED);
+        cur_arena->stats.slab_free_bytes -= run->free * run->size;
+        free_block(payload_to_header(run));
+    }
+}
+
+/**
+ * @brief acquire the lock of the heap profile table; does nothing unless
+ * MM_THREAD_SAFE is set
+ */
+static void profile_lock(void) {
+#if MM_THREAD_SAFE
+    pthread_mutex_lock(&profile_mutex);
+#endif
+}
+
+/**
+ * @brief release the lock of the heap profile table
+ */
+static void profile_unlock(void) {
+#if MM_THREAD_SAFE
+    pthread_mutex_unlock(&profile_mutex);
+#endif
+}
+
+/**
+ * @brief whether an allocation of size bytes is due to be sampled; this is
+ * all an allocation that is not pays for profiling. A due allocation holds
+ * off sampling until profile_record has recorded it, as recording may
+ * allocate itself.
+ *
+ * @param[in] size
+ */
+static bool profile_due(size_t size) {
+    if (!HEAP_PROFILE) {
+        return false;
+    }
+    if (size < profile_countdown) {
+        profile_countdown -= size;
+        return false;
+    }
+    profile_countdown = SIZE_MAX;
+    return true;
+}
+
+/**
+ * @brief draw the bytes until the calling thread's next sample, uniformly
+ * from 1 to twice the rate, so that samples do not lock onto a period in
+ * the program's allocations
+ */
+static void profile_next(void) {
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        profile_countdown = PROFILE_RECHECK;
+        return;
+    }
+    if (profile_seed == 0) {
+        profile_seed = (uint64_t)(uintptr_t)&profile_seed | 1;
+    }
+    // xorshift64
+    profile_seed ^= profile_seed << 13;
+    profile_seed ^= profile_seed >> 7;
+    profile_seed ^= profile_seed << 17;
+    profile_countdown = 1 + (size_t)(profile_seed % (2 * rate));
+}
+
+/**
+ * @brief the home slot of a payload in the profile table
+ *
+ * @param[in] bp
+ */
+static size_t profile_slot(const void *bp) {
+    uint64_t key = (uint64_t)(uintptr_t)bp >> 4;
+    return (size_t)((key * 0x9E3779B97F4A7C15) >> (64 - PROFILE_SLOTS_LOG2));
+}
+
+/**
+ * @brief the counter of a payload in profile_filter
+ *
+ * @param[in] bp
+ */
+static size_t profile_bucket(const void *bp) {
+    return ((uintptr_t)bp >> 4) % PROFILE_FILTER;
+}
+
+/**
+ * @brief write all of len bytes to fd, giving up on an error
+ *
+ * @param[in] fd
+ * @param[in] buf
+ * @param[in] len
+ */
+static void profile_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * @brief dump the profile where the dump signal sends it
+ */
+static void profile_dump_file(void) {
+    int fd = STDERR_FILENO;
+    if (profile_path != NULL) {
+        fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+    }
+    mm_profile_dump(fd);
+    if (fd != STDERR_FILENO) {
+        close(fd);
+    }
+}
+
+/**
+ * @brief the slot of a sampled payload in the profile table, or the free
+ * slot that ends its probe run if it has no sample
+ * precondition: the profile lock is held
+ *
+ * @param[in] bp
+ */
+static size_t profile_find(const void *bp) {
+    size_t i = profile_slot(bp);
+    while (profile_table[i].ptr != NULL && profile_table[i].ptr != bp) {
+        i = (i + 1) % PROFILE_SLOTS;
+    }
+    return i;
+}
+
+/**
+ * @brief take the sample in slot i out of the profile table
+ * precondition: the profile lock is held and slot i is in use
+ *
+ * @param[in] i
+ */
+static void profile_remove(size_t i) {
+    profile_filter[profile_bucket(profile_table[i].ptr)]--;
+    profile_live_bytes -= profile_table[i].size;
+    __atomic_store_n(&profile_live, profile_live - 1, __ATOMIC_RELAXED);
+
+    // Move the rest of the probe run up, so that lookups can stop at the
+    // first free slot: an entry fills the hole unless its home slot lies
+    // between the hole and the entry
+    size_t hole = i;
+    for (size_t j = (i + 1) % PROFILE_SLOTS; profile_table[j].ptr != NULL;
+         j = (j + 1) % PROFILE_SLOTS) {
+        size_t home = profile_slot(profile_table[j].ptr);
+        if (((j - home) & (PROFILE_SLOTS - 1)) >=
+            ((j - hole) & (PROFILE_SLOTS - 1))) {
+            profile_table[hole] = profile_table[j];
+            hole = j;
+        }
+    }
+    profile_table[hole].ptr = NULL;
+}
+
+/**
+ * @brief put a sample in the free slot i of the profile table
+ * precondition: the profile lock is held and slot i is the one profile_find
+ * gave for entry->ptr
+ *
+ * @param[in] i
+ * @param[in] entry
+ */
+static void profile_insert(size_t i, const profile_entry_t *entry) {
+    profile_table[i] = *entry;
+    profile_filter[profile_bucket(entry->ptr)]++;
+    profile_live_bytes += entry->size;
+    __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief whether a payload may have a sample; a single load while nothing
+ * is sampled, and one more for its filter counter when something is
+ *
+ * @param[in] bp
+ */
+static bool profile_maybe(const void *bp) {
+    return HEAP_PROFILE &&
+           __atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0 &&
+           __atomic_load_n(&profile_filter[profile_bucket(bp)],
+                           __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * @brief record a sampled block with the backtrace that allocated it, and
+ * draw the next sample; a sample that would fill the table past 3/4 is
+ * dropped, and one of a block that has a sample already replaces it
+ *
+ * @param[in] bp the payload, NULL if the allocation failed
+ * @param[in] size bytes asked for
+ * @return bp
+ */
+static void *profile_record(void *bp, size_t size) {
+    if (bp != NULL && __atomic_load_n(&profile_rate, __ATOMIC_RELAXED) != 0) {
+        // The first backtrace may allocate, which profile_due holds off
+        void *frames[PROFILE_DEPTH + 1];
+        int depth = backtrace(frames, PROFILE_DEPTH + 1);
+
+        profile_entry_t entry = {.ptr = bp, .size = size};
+        // The innermost frame is this function
+        entry.depth = depth > 1 ? (size_t)depth - 1 : 0;
+        for (size_t f = 0; f < entry.depth; f++) {
+            entry.frames[f] = frames[f + 1];
+        }
+
+        profile_lock();
+        size_t i = profile_find(bp);
+        if (profile_table[i].ptr == bp) {
+            profile_remove(i);
+            i = profile_find(bp);
+        }
+        if (profile_live < PROFILE_SLOTS / 4 * 3) {
+            profile_insert(i, &entry);
+            profile_samples++;
+        }
+        profile_unlock();
+    }
+
+    if (profile_dump_pending) {
+        profile_dump_pending = 0;
+        profile_dump_file();
+    }
+    profile_next();
+    return bp;
+}
+
+/**
+ * @brief drop the sample of a block being freed, if it has one
+ *
+ * @param[in] bp
+ */
+static void profile_forget(void *bp) {
+    if (!profile_maybe(bp)) {
+        return;
+    }
+
+    profile_lock();
+    size_t i = profile_find(bp);
+    if (profile_table[i].ptr == bp) {
+        profile_remove(i);
+    }
+    profile_unlock();
+}
+
+/**
+ * @brief carry the sample of a block realloc resized, if it has one, over to
+ * where the block now is, with the size it now has
+ * precondition: bp is the old payload or one that has no sample
+ *
+ * @param[in] old the payload before the resize
+ * @param[in] bp the payload after it
+ * @param[in] size bytes asked for by the resize
+ */
+static void profile_move(void *old, void *bp, size_t size) {
+    if (!profile_maybe(old)) {
+        return;
+    }
+
+    profile_lock();
+    size_t i = profile_find(old);
+    if (profile_table[i].ptr == old) {
+        profile_entry_t entry = profile_table[i];
+        profile_remove(i);
+        entry.ptr = bp;
+        entry.size = size;
+        profile_insert(profile_find(bp), &entry);
+    }
+    profile_unlock();
+}
+
+/**
+ * @brief forget every sample, as mm_init throws away the blocks they
+ * describe
+ */
+static void profile_reset(void) {
+    profile_lock();
+    if (profile_live != 0) {
+        for (size_t i = 0; i < PROFILE_SLOTS; i++) {
+            profile_table[i].ptr = NULL;
+        }
+        for (size_t i = 0; i < PROFILE_FILTER; i++) {
+            profile_filter[i] = 0;
+        }
+    }
+    __atomic_store_n(&profile_live, 0, __ATOMIC_RELAXED);
+    profile_live_bytes = 0;
+    profile_samples = 0;
+    profile_unlock();
+}
+
+/**
+ * @brief resize the region of a mapped block to hold size payload bytes,
+ * keeping the payload without copying it; the sample of the block in the
+ * heap profile moves with it
+ *
+ * @param[in] block a mapped block
+ * @param[in] size payload bytes
+ * @return the payload of the block, which may have moved; NULL if mem_remap
+ * fails, leaving the block as it was
+ */
+static void *remap_block(block_t *block, size_t size) {
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size_t old_size = get_region_size(block);
+    size_t rsize = round_up(size + 2 * wsize, mem_pagesize());
+    if (rsize == old_size) {
+        profile_move((word_t *)block + 1, (word_t *)block + 1, size);
+        return (word_t *)block + 1;
+    }
+    sbrk_lock();
+    word_t *region = mem_remap((word_t *)block - 1, old_size, rsize);
+    if (region == (void *)-1) {
+        sbrk_unlock();
+        return NULL;
+    }
+    mapped_bytes += rsize - old_size;
+    // Moved before another thread can map the old address again
+    profile_move((word_t *)block + 1, region + 2, size);
+    sbrk_unlock();
+    region[0] = rsize;
+    return region + 2;
+}
+
+#ifndef DRIVER
+/**
+ * @brief handler of the dump signal: the dump happens at the next sample,
+ * which this makes the next allocation of the thread it interrupted, as
+ * writing a dump from the handler could find the table half updated
+ *
+ * @param[in] sig
+ */
+static void profile_signal(int sig) {
+    (void)sig;
+    profile_dump_pending = 1;
+    profile_countdown = 0;
+}
+
+/**
+ * @brief start profiling as the environment asks, once: MM_PROFILE_RATE
+ * is the mean bytes between samples, MM_PROFILE_SIGNAL the number of a
+ * signal that dumps the profile, to MM_PROFILE_FILE or else to stderr
+ */
+static void profile_getenv(void) {
+    static bool done = false;
+    if (done) {
+        return;
+    }
+    done = true;
+
+    const char *rate = getenv("MM_PROFILE_RATE");
+    if (rate == NULL || !mm_profile_start(strtoul(rate, NULL, 10))) {
+        return;
+    }
+    profile_path = getenv("MM_PROFILE_FILE");
+    const char *sig = getenv("MM_PROFILE_SIGNAL");
+    if (sig != NULL) {
+        struct sigaction action = {0};
+        action.sa_handler = profile_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction((int)strtol(sig, NULL, 10), &action, NULL);
+    }
+}
+#endif
+
+/**
+ * @brief give a block of the heap back, to this thread's cache or to the
+ * arena it belongs to
+ * precondition: the block is allocated and neither mapped nor a slab run
+ *
+ * @param[in] block
+ * @param[in] min_size a lower bound on the size of the block, 0 if unknown;
+ * a block known to be too big skips the cache and the quick lists
+ */
+static void release_block(block_t *block, size_t min_size) {
+#if MM_THREAD_SAFE
+    // Small blocks stay in this thread's cache for the next malloc
+    if (min_size <= TCACHE_MAX_SIZE && tcache_put(block)) {
+        return;
+    }
+#endif
+
+    // The block goes back to its own arena, whichever thread frees it
+    arena_lock(arena_of(block));
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (min_size > QUICK_MAX_SIZE || !quick_put(block)) {
+        free_block(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock();
+}
+
+/**
+ * @brief Returns the block after the given one in address order, stepping
+ * over the epilogue and prologue that separate two chunks of the heap.
+ *
+ * @param[in] block
+ * @return the next block, or the epilogue at the end of the heap
+ */
+static block_t *heap_next(block_t *block) {
+    block_t *next = find_next(block);
+    if (get_size(next) == 0 && (char *)next + wsize <= (char *)mem_heap_hi()) {
+        next = (block_t *)((char *)next + dsize);
+    }
+    return next;
+}
+
+/**
+ * @brief  function checks if the initial and final blocks of the heap are
+ * correctly formatted.
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_epi_pro_logue(void) {
+    word_t *initial_heap = mem_heap_lo();
+    if (extract_size(*initial_heap) != 0 ||
+        extract_alloc(*initial_heap) == false) {
+        return false;
+    }
+
+    word_t *epilogue = (word_t *)((char *)mem_heap_hi() - 7);
+
+    if (extract_size(*epilogue) != 0 || extract_alloc(*epilogue) == false) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief The function checks if the memory blocks in the heap are aligned on a
+ * 16-byte boundary.
+ *
+ * @return The function `mm_check_alignment` returns a boolean value.
+ */
+static bool mm_check_alignment(void) {
+    block_t *current;
+    for (current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        char *bp = header_to_payload(current);
+
+        if (((word_t)bp % (word_t)16) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief function checks if coalescing is correctly implemented in the memory
+ * management system.
+ *
+ * @return a boolean value. If all the conditions in the function are satisfied,
+ * it will return true. Otherwise, it will return false.
+ */
+static bool mm_check_coalescing(void) {
+    block_t *current;
+    for (current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+
+        if (get_alloc(current) == false) {
+            if (current == heap_start) {
+                if (get_alloc(find_next(current)) == false) {
+                    return false;
+                }
+            }
+
+            if (get_prev_alloc(current) == false ||
+                get_alloc(find_next(current)) == false) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief  function `mm_check_boundaries` checks if the boundaries of the heap
+ * are within the expected range.
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_boundaries(void) {
+    char *initial_heap = (char *)mem_heap_lo() + 8;
+    char *epilogue = ((char *)mem_heap_hi() - 7);
+    block_t *current;
+    for (current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        char *bp = (char *)current;
+
+        if ((word_t)bp < (word_t)initial_heap ||
+            (word_t)current > (word_t)epilogue) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief The function `mm_check_header_footer` checks if the headers and
+ * footers of all blocks in the heap are consistent.
+ *
+ * @return a boolean value. If all the header and footer pairs in the heap are
+ * valid, the function will return true. Otherwise, it will return false.
+ */
+static bool mm_check_header_footer(void) {
+
+    for (block_t *current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        if (!get_alloc(current)) {
+            size_t size = get_size(current);
+            if (size < min_block_size) {
+                return false;
+            }
+
+            word_t *footer = header_to_footer(current);
+            bool result = get_alloc(current) == extract_alloc(*footer);
+
+            if (!result) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief The function `mm_check_tree_node` checks one subtree of the
+ * size-ordered tree of the last bucket: every node lies in the heap, is free
+ * and has a size strictly between lo and hi, the stored heights are correct
+ * and AVL balanced, and the blocks of the same size are linked correctly
+ * behind their node.
+ *
+ * @param[in] node root of the subtree
+ * @param[in] lo lower bound (exclusive) of the sizes in the subtree
+ * @param[in] hi upper bound (exclusive) of the sizes in the subtree
+ * @param[out] count incremented by the number of blocks in the subtree
+ * @return the height of the subtree, or -1 if it is broken
+ */
+static long mm_check_tree_node(block_t *node, size_t lo, size_t hi,
+                               size_t *count) {
+    if (node == NULL) {
+        return 0;
+    }
+    block_t *initial_heap = (block_t *)((char *)mem_heap_lo() + 8);
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    if (node < initial_heap || node > epilogue || get_alloc(node) ||
+        *get_prev(node) != NULL) {
+        return -1;
+    }
+
+    size_t size = get_size(node);
+    if (size <= lo || size >= hi || size < MAX_SIZE) {
+        return -1;
+    }
+
+    (*count)++;
+    block_t *prev = node;
+    for (block_t *current = *get_next(node); current != NULL;
+         current = *get_next(current)) {
+        if (current < initial_heap || current > epilogue ||
+            get_alloc(current) || get_size(current) != size ||
+            *get_prev(current) != prev) {
+            return -1;
+        }
+        (*count)++;
+        prev = current;
+    }
+
+    long left = mm_check_tree_node(*get_left(node), lo, size, count);
+    long right = mm_check_tree_node(*get_right(node), size, hi, count);
+    if (left < 0 || right < 0 || left > right + 1 || right > left + 1) {
+        return -1;
+    }
+    long height = (left > right ? left : right) + 1;
+    if ((size_t)height != tree_height(node)) {
+        return -1;
+    }
+    return height;
+}
+
+/**
+ * @brief The function `mm_check_tree` checks the size-ordered tree that holds
+ * the last bucket of the seglist.
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_tree(void) {
+    size_t count = 0;
+    return mm_check_tree_node(cur_arena->seglist[TREE_BUCKET], 0, SIZE_MAX,
+                              &count) >= 0;
+}
+
+/**
+ * @brief function `mm_check_prev_next` checks if the previous and next pointers
+ * of each block in the `seglist` are correctly set.
+ *
+ * @return a boolean value. If all the previous and next pointers in the seglist
+ * are correctly linked, the function will return true. Otherwise, it will
+ * return false.
+ */
+static bool mm_check_prev_next(void) {
+    for (size_t i = 0; i < TREE_BUCKET; i++) {
+        block_t *current = cur_arena->seglist[i];
+
+        while (current != NULL && (*get_next(current)) != NULL) {
+            block_t *next = *get_next(current);
+            block_t *next_prev = *get_prev(next);
+
+            bool result = next_prev == current;
+
+            if (!result) {
+                return false;
+            }
+
+            current = next;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief function `mm_check_pointer_heap` checks if all pointers in the heap
+ * are valid.
+ *
+ * @return a boolean value. It returns true if all the pointers in the heap are
+ * within the valid range (between initial_heap and epilogue) and false
+ * otherwise.
+ */
+static bool mm_check_pointer_heap(void) {
+    block_t *initial_heap = (block_t *)((char *)mem_heap_lo() + 8);
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+
+    for (size_t i = 0; i < TREE_BUCKET; i++) {
+        block_t *current = cur_arena->seglist[i];
+
+        while (current != NULL) {
+            block_t *next = *get_next(current);
+            block_t *prev = *get_prev(current);
+
+            bool result_prev = (prev == NULL) ||
+                               ((prev >= initial_heap) && (prev <= epilogue));
+            bool result_next = (next == NULL) ||
+                               ((next >= initial_heap) && (next <= epilogue));
+            bool result_owner = arena_of(current) == cur_arena;
+
+            if (!(result_next && result_prev && result_owner)) {
+
+                return false;
+            }
+
+            current = next;
+        }
+    }
+
+    block_t *mini_prev = NULL;
+    for (block_t *current = cur_arena->small_block_start; current != NULL;
+         current = current->data.miniblock.next) {
+
+        bool result_next_mini =
+            (current >= initial_heap) && (current <= epilogue);
+        if (!result_next_mini || arena_of(current) != cur_arena) {
+            return false;
+        }
+        if (!(current->header & mini_tag_mask) ||
+            get_mini_prev(current) != mini_prev) {
+            return false;
+        }
+        mini_prev = current;
+    }
+    return true;
+}
+
+/**
+ * @brief The function `mm_check_free_count` checks if the number of free blocks
+ * in the heap is equal to the number of free blocks in the segregated free
+ * lists and small block list.
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_free_count(void) {
+    size_t heap_count = 0;
+    size_t free_count = 0;
+    for (block_t *current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        if (!get_alloc(current)) {
+            heap_count++;
+        }
+    }
+
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        arena_t *arena = &arenas[a];
+        for (size_t i = 0; i < TREE_BUCKET; i++) {
+            block_t *current = arena->seglist[i];
+
+            while (current != NULL) {
+
+                free_count++;
+
+                current = *get_next(current);
+            }
+        }
+        for (block_t *current = arena->small_block_start; current != NULL;
+             current = current->data.miniblock.next) {
+            free_count++;
+        }
+        mm_check_tree_node(arena->seglist[TREE_BUCKET], 0, SIZE_MAX,
+                           &free_count);
+    }
+
+    return heap_count == free_count;
+}
+
+/**
+ * @brief The function `mm_check_seglist_range` checks if the sizes of blocks in
+ * the seglist are within the expected range for each bucket, that the lists
+ * kept in address order are, and that with next fit the rover of each
+ * bucket is one of its blocks.
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_seglist_range(void) {
+
+    for (size_t i = 0; i < TREE_BUCKET; i++) {
+        block_t *current = cur_arena->seglist[i];
+        size_t range_left = bucket_min_size(i);
+
+        size_t range_right = bucket_min_size(i + 1);
+        bool rover_found = true;
+#if PLACEMENT == PLACE_NEXT_FIT
+        rover_found = cur_arena->rover[i] == NULL;
+#endif
+        while (current != NULL) {
+
+            size_t size = get_size(current);
+            bool result = size >= range_left && size < range_right;
+
+            if (!result) {
+
+                return false;
+            }
+#if PLACEMENT == PLACE_NEXT_FIT
+            rover_found = rover_found || cur_arena->rover[i] == current;
+#endif
+#if ADDRESS_ORDER_SIZE
+            block_t *next = *get_next(current);
+            if (i >= get_bucket(ADDRESS_ORDER_SIZE) && next != NULL &&
+                next < current) {
+                return false;
+            }
+#endif
+
+            current = *get_next(current);
+        }
+        if (!rover_found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief The function `mm_check_bitmap` checks that the occupancy bitmap has
+ * a bit set for exactly the non-empty buckets of the seglist.
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_bitmap(void) {
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        bool occupied = (cur_arena->seglist_bitmap >> i) & 1;
+        if (occupied != (cur_arena->seglist[i] != NULL)) {
+            return false;
+        }
+    }
+    return (cur_arena->seglist_bitmap >> BUCKET_SIZE) == 0;
+}
+
+/**
+ * @brief check that the end of the current arena's last chunk that zero_start
+ * claims untouched is zero, apart from the top block's links and footer
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_zero_tail(void) {
+    block_t *epilogue = cur_arena->epilogue;
+    char *from = cur_arena->zero_start;
+    if (!FRESH_HEAP_ZERO || epilogue == NULL || from >= (char *)epilogue) {
+        return true;
+    }
+    // Only a free block can reach into the untouched memory
+    block_t *top = find_top();
+    if (top == NULL) {
+        return false;
+    }
+    char *links = (char *)header_to_payload(top) + sizeof(union Data);
+    if (links > from) {
+        from = links;
+    }
+    for (word_t *word = (word_t *)from; word < header_to_footer(top);
+         word++) {
+        if (*word != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check that the blocks marked in slab_pages are exactly the slab
+ * runs: allocated, SLAB_RUN_SIZE bytes and aligned to their size
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_slab_pages(void) {
+    block_t *current;
+    for (current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        char *bp = header_to_payload(current);
+        slab_t *run = slab_of(bp);
+        if (run == NULL) {
+            continue;
+        }
+        if ((char *)run != bp || !get_alloc(current) ||
+            get_size(current) != SLAB_RUN_SIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check the runs on the slab lists of the current arena: each has a
+ * free object, as many free objects as bits in its map, and is marked in
+ * slab_pages
+ *
+ * @return a boolean value.
+ */
+static bool mm_check_slabs(void) {
+    size_t classes = SLAB_CLASSES;
+    for (size_t c = 0; c < classes; c++) {
+        slab_t *prev = NULL;
+        for (slab_t *run = cur_arena->slabs[c]; run != NULL;
+             run = run->next) {
+            size_t count = 0;
+            for (size_t i = 0; i < SLAB_MAP_WORDS; i++) {
+                count += (size_t)__builtin_popcountl(run->free_map[i]);
+            }
+            if (run->prev != prev || run->arena != cur_arena ||
+                run->size != (c + 1) * dsize || run->free == 0 ||
+                run->free != count || count > slab_capacity(run->size) ||
+                slab_of((char *)run + sizeof(slab_t)) != run) {
+                return false;
+            }
+            prev = run;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check that the quick lists of the current arena hold allocated heap
+ * blocks of their size, and as many bytes as the arena counts
+ *
+ * @return true if the quick lists are consistent
+ */
+static bool mm_check_quick(void) {
+    size_t bytes = 0;
+    for (size_t bin = 0; bin < QUICK_BINS; bin++) {
+        for (block_t *block = cur_arena->quick[bin]; block != NULL;
+             block = block->data.miniblock.next) {
+            if ((void *)block < mem_heap_lo() ||
+                (void *)block > mem_heap_hi() || !get_alloc(block) ||
+                get_size(block) != (bin + 1) * dsize) {
+                return false;
+            }
+            bytes += get_size(block);
+        }
+    }
+    return bytes == cur_arena->quick_bytes &&
+           (defer_coalescing || bytes == 0);
+}
+
+/**
+ * @brief check that the counters of the current arena agree with a walk of
+ * its free blocks and slab runs
+ *
+ * @return true if every byte count matches
+ */
+static bool mm_check_stats(void) {
+    size_t free_bytes[BUCKET_SIZE] = {0};
+    size_t mini_bytes = 0;
+    for (block_t *current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        if (get_alloc(current) || arena_of(current) != cur_arena) {
+            continue;
+        }
+        size_t size = get_size(current);
+        if (size == min_block_size) {
+            mini_bytes += size;
+        } else {
+            free_bytes[get_bucket(size)] += size;
+        }
+    }
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        if (free_bytes[i] != cur_arena->stats.free_bytes[i]) {
+            return false;
+        }
+    }
+
+    size_t slab_free_bytes = 0;
+    size_t classes = SLAB_CLASSES;
+    for (size_t c = 0; c < classes; c++) {
+        for (slab_t *run = cur_arena->slabs[c]; run != NULL; run = run->next) {
+            slab_free_bytes += run->free * run->size;
+        }
+    }
+    return mini_bytes == cur_arena->stats.mini_bytes &&
+           slab_free_bytes == cur_arena->stats.slab_free_bytes;
+}
+
+/**
+ * @brief check heap whether heap is valid without any error
+ * check freelist is valid and each of the block is valid
+ *
+ * In the thread-safe build this walks every arena, so it must only be called
+ * while no other thread is inside the allocator.
+ *
+ * @param[in] line
+ * @return true if the heap is valid without any error, otherwise false
+ */
+bool mm_checkheap(int line) {
+
+    bool check_epi_pro = mm_check_epi_pro_logue();
+    bool check_alignment = mm_check_alignment();
+    bool check_coalescing = mm_check_coalescing();
+    bool check_boundaries = mm_check_boundaries();
+    bool check_header_footer = mm_check_header_footer();
+    bool check_free_count = mm_check_free_count();
+    bool check_slab_pages = mm_check_slab_pages();
+
+    // The free lists are checked arena by arena
+    bool check_prev_next = true;
+    bool check_pointer_heap = true;
+    bool check_seglist_range = true;
+    bool check_bitmap = true;
+    bool check_tree = true;
+    bool check_zero_tail = true;
+    bool check_slabs = true;
+    bool check_quick = true;
+    bool check_stats = true;
+    arena_t *saved_arena = cur_arena;
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        cur_arena = &arenas[a];
+        check_prev_next = mm_check_prev_next() && check_prev_next;
+        check_pointer_heap = mm_check_pointer_heap() && check_pointer_heap;
+        check_seglist_range = mm_check_seglist_range() && check_seglist_range;
+        check_bitmap = mm_check_bitmap() && check_bitmap;
+        check_tree = mm_check_tree() && check_tree;
+        check_zero_tail = mm_check_zero_tail() && check_zero_tail;
+        check_slabs = mm_check_slabs() && check_slabs;
+        check_quick = mm_check_quick() && check_quick;
+        check_stats = mm_check_stats() && check_stats;
+    }
+    cur_arena = saved_arena;
+
+    if (!check_epi_pro) {
+        dbg_printf("epi or pro logue error\n");
+    }
+    if (!check_alignment) {
+        dbg_printf("alignment error\n");
+    }
+    if (!check_coalescing) {
+        dbg_printf("coalescing error\n");
+    }
+    if (!check_boundaries) {
+        dbg_printf("boundaries error\n");
+    }
+    if (!check_header_footer) {
+        dbg_printf("header_footer error or size error\n");
+    }
+    if (!check_prev_next) {
+        dbg_printf("Pointer error\n");
+    }
+    if (!check_pointer_heap) {
+        dbg_printf("Pointer is not in the heap\n");
+    }
+
+    if (!check_free_count) {
+        dbg_printf(" free count error\n");
+    }
+
+    if (!check_seglist_range) {
+        dbg_printf("seglist range error\n");
+    }
+    if (!check_bitmap) {
+        dbg_printf("seglist bitmap error\n");
+    }
+    if (!check_tree) {
+        dbg_printf("large block tree error\n");
+    }
+    if (!check_zero_tail) {
+        dbg_printf("untouched heap tail is not zero\n");
+    }
+    if (!check_slab_pages || !check_slabs) {
+        dbg_printf("slab run error\n");
+    }
+    if (!check_quick) {
+        dbg_printf("quick list error\n");
+    }
+    if (!check_stats) {
+        dbg_printf("free byte counters error\n");
+    }
+    return check_epi_pro && check_alignment && check_coalescing &&
+           check_boundaries && check_header_footer && check_prev_next &&
+           check_pointer_heap && check_free_count && check_seglist_range &&
+           check_bitmap && check_tree && check_zero_tail && check_slab_pages &&
+           check_slabs && check_quick && check_stats;
+}
+
+/**
+ * @brief whether this build may be called from several threads at once
+ *
+ * @return MM_THREAD_SAFE
  */
-static bool mm_check_prev_next(void) {
-    for (size_t i = 0; i < BUCKET_SIZE; i++) {
-        block_t *current = seglist[i];
+bool mm_thread_safe(void) {
+    return MM_THREAD_SAFE;
+}
 
-        while (current != NULL && (*get_next(current)) != NULL) {
-            block_t *next = *get_next(current);
-            block_t *next_prev = *get_prev(next);
+/**
+ * @brief choose whether free defers coalescing, see DEFER_COALESCE; takes
+ * effect at the next mm_init
+ *
+ * @param[in] defer
+ * @return the previous choice
+ */
+bool mm_defer_coalescing(bool defer) {
+    bool previous = defer_requested;
+    defer_requested = defer;
+    return previous;
+}
 
-            bool result = next_prev == current;
+/**
+ * @brief initialize the heap, prologue and epilogue
+ * precodition: initialization
+ * postcondition: there is a available heap
+ *
+ * @param[in] void
+ * @return
+ */
+bool mm_init(void) {
 
-            if (!result) {
-                return false;
-            }
+    // Create the initial empty heap
+    word_t *start = (word_t *)(mem_sbrk((intptr_t)(2 * wsize)));
 
-            current = next;
+    if (start == (void *)-1) {
+        return false;
+    }
+    size_t classes = SLAB_CLASSES;
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        for (int i = 0; i < BUCKET_SIZE; i++) {
+            arenas[a].seglist[i] = NULL;
+#if PLACEMENT == PLACE_NEXT_FIT
+            arenas[a].rover[i] = NULL;
+#endif
+#if PLACEMENT == PLACE_GOOD_FIT
+            arenas[a].search_depth[i] = SEARCH_LIMIT;
+            arenas[a].search_votes[i] = 0;
+            arenas[a].searched[i] = false;
+#endif
+        }
+        arenas[a].seglist_bitmap = 0;
+        arenas[a].small_block_start = NULL;
+        arenas[a].epilogue = NULL;
+        arenas[a].zero_start = NULL;
+        for (size_t i = 0; i < classes; i++) {
+            arenas[a].slabs[i] = NULL;
+            arenas[a].slab_waits[i] = 0;
         }
+        for (size_t i = 0; i < QUICK_BINS; i++) {
+            arenas[a].quick[i] = NULL;
+        }
+        arenas[a].quick_bytes = 0;
+        arenas[a].heap_bytes = 0;
+        arenas[a].grow_step = chunksize;
+        arenas[a].stats = (arena_stats_t){0};
+    }
+    defer_coalescing = defer_requested;
+    mapped_bytes = 0;
+    realloc_copies = 0;
+    realloc_copy_bytes = 0;
+    profile_reset();
+#ifndef DRIVER
+    profile_getenv();
+#endif
+
+    for (size_t i = 0; i < SLAB_SPAN / SLAB_RUN_SIZE / 64; i++) {
+        slab_pages[i] = 0;
+    }
+
+    start[0] = pack(0, true, true, false); // Heap prologue (block footer)
+    start[1] = pack(0, true, true, false); // Heap epilogue (block header)
+
+    // The first chunk of the heap belongs to the first arena
+    cur_arena = &arenas[0];
+    cur_arena->epilogue = (block_t *)&(start[1]);
+#if MM_THREAD_SAFE
+    pthread_once(&arena_once, arena_init_locks);
+    heap_generation++;
+    chunks[0].start = (char *)start;
+    chunks[0].arena = cur_arena;
+    chunk_count = 1;
+#endif
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
+        return false;
     }
 
+    // Heap starts with first "block header", published last so that other
+    // threads only see a complete heap
+    __atomic_store_n(&heap_start, (block_t *)&(start[1]), __ATOMIC_RELEASE);
+
     return true;
 }
 
 /**
- * @brief function `mm_check_pointer_heap` checks if all pointers in the heap
- * are valid.
+ * @brief Allocate memory from heap, splite and coalesce the approiated block
+ * and return porinter of the requested block preconidtion: the heap has
+ * available memory size postconditon: return the pointer of the block and
+ * maintain the seglist
  *
- * @return a boolean value. It returns true if all the pointers in the heap are
- * within the valid range (between initial_heap and epilogue) and false
- * otherwise.
+ * @param[in] size
+ * @return pointer of the requested block
  */
-static bool mm_check_pointer_heap(void) {
-    block_t *initial_heap = (block_t *)((char *)mem_heap_lo() + 8);
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+static void *alloc_payload(size_t size) {
+    size_t asize; // Adjusted block size
+    block_t *block;
+    void *bp = NULL;
 
-    for (size_t i = 0; i < BUCKET_SIZE; i++) {
-        block_t *current = seglist[i];
+#if MM_THREAD_SAFE
+    // Small requests are served from this thread's cache without the lock
+    if (size != 0 && size <= TCACHE_MAX_SIZE - wsize) {
+        block = tcache_get(round_up(size + wsize, dsize));
+        if (block != NULL) {
+            dbg_ensures(!get_realloc_grown(block));
+            return header_to_payload(block);
+        }
+    }
+#endif
 
-        while (current != NULL) {
-            block_t *next = *get_next(current);
-            block_t *prev = *get_prev(current);
+    // Initialize heap if it isn't initialized
+    if (!heap_ready()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
+    }
 
-            bool result_prev = (prev == NULL) ||
-                               ((prev >= initial_heap) && (prev <= epilogue));
-            bool result_next = (next == NULL) ||
-                               ((next >= initial_heap) && (next <= epilogue));
+    arena_lock(get_thread_arena());
+    dbg_requires(mm_checkheap(__LINE__));
 
-            if (!(result_next && result_prev)) {
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock();
+        return bp;
+    }
 
-                return false;
-            }
+    // Huge requests get a region of their own, outside of any arena
+    if (MMAP_THRESHOLD != 0 && size > MMAP_THRESHOLD) {
+        arena_unlock();
+        return map_block(size);
+    }
 
-            current = next;
+    // Small requests are packed into slab runs when leaving out the header
+    // saves a size class; otherwise a run only adds fragmentation
+    size_t ssize = round_up(size, dsize);
+    if (size <= SLAB_MAX_SIZE && ssize < round_up(size + wsize, dsize)) {
+        bp = slab_alloc(ssize);
+        if (bp != NULL) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            arena_unlock();
+            return bp;
         }
     }
 
-    for (block_t *current = small_block_start; current != NULL;
-         current = current->data.miniblock.next) {
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + wsize, dsize);
 
-        bool result_next_mini =
-            (current >= initial_heap) && (current <= epilogue);
-        if (!result_next_mini) {
-            return false;
+    block = quick_get(asize);
+    if (block == NULL) {
+        block = alloc_block(asize);
+    }
+    if (block != NULL) {
+        bp = header_to_payload(block);
+#if MM_THREAD_SAFE
+        if (asize <= TCACHE_MAX_SIZE) {
+            tcache_fill(asize);
         }
+#endif
     }
-    return true;
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock();
+    return bp;
 }
 
 /**
- * @brief The function `mm_check_free_count` checks if the number of free blocks
- * in the heap is equal to the number of free blocks in the segregated free
- * lists and small block list.
+ * @brief allocate size bytes, see alloc_payload; now and then a request is
+ * sampled for the heap profile
  *
- * @return a boolean value.
+ * @param[in] size
+ * @return pointer of the requested block
  */
-static bool mm_check_free_count(void) {
-    size_t heap_count = 0;
-    size_t free_count = 0;
-    for (block_t *current = heap_start; get_size(current) > 0;
-         current = find_next(current)) {
-        if (!get_alloc(current)) {
-            heap_count++;
-        }
+void *malloc(size_t size) {
+    if (profile_due(size)) {
+        return profile_record(alloc_payload(size), size);
     }
+    return alloc_payload(size);
+}
 
-    for (size_t i = 0; i < BUCKET_SIZE; i++) {
-        block_t *current = seglist[i];
-
-        while (current != NULL) {
-
-            free_count++;
+/**
+ * @brief Free the the allocated memory
+ * precodition: the block is allocated
+ * postcondition: the allocated block is free
+ * @param[in] bp
+ * @return void
+ */
+void free(void *bp) {
+    if (bp == NULL) {
+        return;
+    }
+    profile_forget(bp);
 
-            current = *get_next(current);
-        }
+    slab_t *run = slab_of(bp);
+    if (run != NULL) {
+        arena_lock(run->arena);
+        dbg_requires(mm_checkheap(__LINE__));
+        slab_free(run, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock();
+        return;
     }
-    for (block_t *current = small_block_start; current != NULL;
-         current = current->data.miniblock.next) {
-        free_count++;
+
+    block_t *block = payload_to_header(bp);
+    if (is_mapped(block)) {
+        unmap_block(block);
+        return;
     }
 
-    return heap_count == free_count;
+    release_block(block, 0);
 }
 
 /**
- * @brief The function `mm_check_seglist_range` checks if the sizes of blocks in
- * the seglist are within the expected range for each bucket.
+ * @brief free an allocated block whose size the caller knows, as C++ does
+ * at delete; a block too big for a slab run and too small to be mapped
+ * skips both lookups and goes straight back to the heap. The size gives
+ * the size class of the block, but a freed block merges with its free
+ * neighbours before it is filed, so the size can not pick its bucket; it
+ * does tell a block too big for the cache and the quick lists.
+ * precondition: size is what the block was last allocated or resized with;
+ * only a block realloc moved, with room to grow, is of a larger class
  *
- * @return a boolean value.
+ * @param[in] bp
+ * @param[in] size
  */
-static bool mm_check_seglist_range(void) {
-
-    for (size_t i = 0; i < 6; i++) {
-        block_t *current = seglist[i];
-        size_t range_left = 32 + 16 * i;
-
-        size_t range_right = 32 + 16 * (i + 1);
-        while (current != NULL) {
+void mm_free_sized(void *bp, size_t size) {
+    if (bp == NULL) {
+        return;
+    }
+    profile_forget(bp);
 
-            size_t size = get_size(current);
-            bool result = size >= range_left && size < range_right;
+    block_t *block = payload_to_header(bp);
+    dbg_assert(slab_of(bp) != NULL ? size <= slab_of(bp)->size
+                                   : size <= get_payload_size(block));
+
+    // realloc moves an object out of its slab run once it outgrows the
+    // run, and a block out of its region once it is no longer huge
+    if (size <= SLAB_MAX_SIZE ||
+        (MMAP_THRESHOLD != 0 && size > MMAP_THRESHOLD)) {
+        free(bp);
+        return;
+    }
+    dbg_assert(slab_of(bp) == NULL && !is_mapped(block));
 
-            if (!result) {
+    // The header must agree with the size, as blocks are split to theirs
+    size_t asize = round_up(size + wsize, dsize);
+    dbg_assert(get_realloc_grown(block) ||
+               get_bucket(asize) == get_bucket(get_size(block)));
 
-                return false;
-            }
+    release_block(block, asize);
+}
 
-            current = *get_next(current);
-        }
+/**
+ * @brief allocate size bytes whose address is a multiple of alignment. The
+ * block comes from a free block that holds it at an aligned address, and the
+ * slack before and after it is split off and goes back to the free lists.
+ * Aligned blocks always live in the heap, as the payload of a mapped region
+ * is at a fixed offset from its start.
+ *
+ * @param[in] alignment a power of 2
+ * @param[in] size
+ * @return the payload, NULL if size is 0, alignment is not a power of 2 or
+ * the heap can not grow
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    // Every payload is aligned to dsize anyway
+    if (alignment <= dsize) {
+        return malloc(size);
+    }
+    if (size == 0 || size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+    if (profile_due(size)) {
+        return profile_record(mm_memalign(alignment, size), size);
     }
-    for (size_t i = 6; i < BUCKET_SIZE; i++) {
-        block_t *current = seglist[i];
-        size_t range_left = 1 << (i + 1);
-
-        size_t range_right = 1 << (i + 2);
-        while (current != NULL) {
-            if (i == BUCKET_SIZE - 1) {
-                bool result = get_size(current) >= MAX_SIZE;
-                if (!result) {
 
-                    return false;
-                }
-            } else {
-                size_t size = get_size(current);
-                bool result = size >= range_left && size < range_right;
+    if (!heap_ready()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
+    }
 
-                if (!result) {
+    arena_lock(get_thread_arena());
+    dbg_requires(mm_checkheap(__LINE__));
 
-                    return false;
-                }
-            }
+    block_t *block =
+        alloc_aligned_block(round_up(size + wsize, dsize), alignment);
 
-            current = *get_next(current);
-        }
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock();
+    if (block == NULL) {
+        return NULL;
     }
-    return true;
+    dbg_ensures(((size_t)header_to_payload(block) & (alignment - 1)) == 0);
+    return header_to_payload(block);
 }
 
 /**
- * @brief check heap whether heap is valid without any error
- * check freelist is valid and each of the block is valid
- *
+ * @brief the number of bytes the caller may use at bp, which is at least what
+ * it asked for: sizes are rounded up to 16 bytes, a block is not split when
+ * the rest would be too small to be a block, and a slab object has the size
+ * of its run
+ * precondition: bp is NULL or allocated
  *
- * @param[in] line
- * @return true if the heap is valid without any error, otherwise false
+ * @param[in] bp
+ * @return the usable size of the payload, 0 if bp is NULL
  */
-bool mm_checkheap(int line) {
+size_t mm_malloc_usable_size(void *bp) {
+    if (bp == NULL) {
+        return 0;
+    }
 
-    bool check_epi_pro = mm_check_epi_pro_logue();
-    bool check_alignment = mm_check_alignment();
-    bool check_coalescing = mm_check_coalescing();
-    bool check_boundaries = mm_check_boundaries();
-    bool check_header_footer = mm_check_header_footer();
-    bool check_prev_next = mm_check_prev_next();
-    bool check_pointer_heap = mm_check_pointer_heap();
-    bool check_free_count = mm_check_free_count();
-    bool check_seglist_range = mm_check_seglist_range();
+    slab_t *run = slab_of(bp);
+    if (run != NULL) {
+        return run->size;
+    }
 
-    if (!check_epi_pro) {
-        dbg_printf("epi or pro logue error\n");
+    block_t *block = payload_to_header(bp);
+    dbg_assert(get_alloc(block));
+    return get_payload_size(block);
+}
+
+/**
+ * @brief fill in the counters of the allocator. Every count is kept up to
+ * date as the heap changes, so this takes each arena lock only long enough
+ * to add its counters up and never walks the heap. Blocks in the per-thread
+ * caches count as in use. The search depth of a bucket is the mean over the
+ * arenas that have searched it; SEARCH_LIMIT means the depth was never
+ * tuned, as is usual for an exact-size bucket, whose first block fits.
+ *
+ * @param[out] stats
+ */
+void mm_stats(struct mm_stats *stats) {
+    *stats = (struct mm_stats){0};
+    stats->buckets = BUCKET_SIZE;
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        stats->bucket_min_size[i] = bucket_min_size(i);
     }
-    if (!check_alignment) {
-        dbg_printf("alignment error\n");
+#if PLACEMENT == PLACE_GOOD_FIT
+    stats->search_limit = SEARCH_LIMIT;
+    // A bucket no arena has searched keeps the depth every bucket starts at
+    size_t depth_sum[TREE_BUCKET] = {0};
+    size_t searchers[TREE_BUCKET] = {0};
+    for (size_t i = 0; i < TREE_BUCKET; i++) {
+        stats->bucket_search_depth[i] = SEARCH_LIMIT;
     }
-    if (!check_coalescing) {
-        dbg_printf("coalescing error\n");
+#endif
+    if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) == NULL) {
+        return;
     }
-    if (!check_boundaries) {
-        dbg_printf("boundaries error\n");
+
+    size_t free_bytes = 0;
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        arena_lock(&arenas[a]);
+        const arena_stats_t *counts = &arenas[a].stats;
+        stats->heap_bytes += arenas[a].heap_bytes;
+        stats->deferred_bytes += arenas[a].quick_bytes;
+        stats->mini_free_bytes += counts->mini_bytes;
+        for (size_t i = 0; i < BUCKET_SIZE; i++) {
+            stats->bucket_free_bytes[i] += counts->free_bytes[i];
+            free_bytes += counts->free_bytes[i];
+        }
+        stats->slab_free_bytes += counts->slab_free_bytes;
+#if PLACEMENT == PLACE_GOOD_FIT
+        for (size_t i = 0; i < TREE_BUCKET; i++) {
+            if (arenas[a].searched[i]) {
+                depth_sum[i] += arenas[a].search_depth[i];
+                searchers[i]++;
+            }
+        }
+#endif
+        stats->sbrks += counts->sbrks;
+        stats->fit_searches += counts->fit_searches;
+        stats->fit_probes += counts->fit_probes;
+        stats->splits += counts->splits;
+        stats->coalesces += counts->coalesces;
+        arena_unlock();
     }
-    if (!check_header_footer) {
-        dbg_printf("header_footer error or size error\n");
+    sbrk_lock();
+    stats->mapped_bytes = mapped_bytes;
+    sbrk_unlock();
+    profile_lock();
+    stats->profile_samples = profile_samples;
+    stats->profile_live = profile_live;
+    stats->profile_live_bytes = profile_live_bytes;
+    profile_unlock();
+    stats->realloc_copies = __atomic_load_n(&realloc_copies, __ATOMIC_RELAXED);
+    stats->realloc_copy_bytes =
+        __atomic_load_n(&realloc_copy_bytes, __ATOMIC_RELAXED);
+
+#if PLACEMENT == PLACE_GOOD_FIT
+    for (size_t i = 0; i < TREE_BUCKET; i++) {
+        if (searchers[i] != 0) {
+            stats->bucket_search_depth[i] = depth_sum[i] / searchers[i];
+        }
     }
-    if (!check_prev_next) {
-        dbg_printf("Pointer error\n");
+#endif
+    stats->in_use_bytes = stats->heap_bytes - free_bytes -
+                          stats->mini_free_bytes - stats->deferred_bytes -
+                          stats->slab_free_bytes + stats->mapped_bytes;
+}
+
+/**
+ * @brief describe how the free bytes of the heap are spread out, walking
+ * every block of the heap with all arenas locked. Meant for analysis: it
+ * takes time in proportion to the heap and stalls every other thread.
+ *
+ * @param[out] frag
+ */
+void mm_heap_frag(struct mm_frag *frag) {
+    *frag = (struct mm_frag){0};
+    frag->buckets = BUCKET_SIZE;
+    for (size_t i = 0; i < BUCKET_SIZE; i++) {
+        frag->bucket_min_size[i] = bucket_min_size(i);
     }
-    if (!check_pointer_heap) {
-        dbg_printf("Pointer is not in the heap\n");
+    if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) == NULL) {
+        return;
     }
 
-    if (!check_free_count) {
-        dbg_printf(" free count error\n");
+    arena_lock_all();
+    for (block_t *current = heap_start; get_size(current) > 0;
+         current = heap_next(current)) {
+        if (get_alloc(current)) {
+            continue;
+        }
+        size_t size = get_size(current);
+        frag->free_bytes += size;
+        frag->largest_free = max(frag->largest_free, size);
+        if (size == min_block_size) {
+            frag->mini_free_blocks++;
+        } else {
+            frag->bucket_free_blocks[get_bucket(size)]++;
+            frag->bucket_free_bytes[get_bucket(size)] += size;
+        }
     }
-
-    if (!check_seglist_range) {
-        dbg_printf("seglist range error\n");
+    for (size_t a = 0; a < MM_ARENAS; a++) {
+        frag->heap_bytes += arenas[a].heap_bytes;
+        frag->deferred_bytes += arenas[a].quick_bytes;
+        frag->slab_free_bytes += arenas[a].stats.slab_free_bytes;
     }
-    return check_epi_pro && check_alignment && check_coalescing &&
-           check_boundaries && check_header_footer && check_prev_next &&
-           check_pointer_heap && check_free_count && check_seglist_range;
+    sbrk_lock();
+    frag->mapped_bytes = mapped_bytes;
+    sbrk_unlock();
+    arena_unlock_all();
+
+    frag->in_use_bytes = frag->heap_bytes - frag->free_bytes -
+                         frag->deferred_bytes - frag->slab_free_bytes +
+                         frag->mapped_bytes;
 }
 
 /**
- * @brief initialize the heap, prologue and epilogue
- * precodition: initialization
- * postcondition: there is a available heap
+ * @brief sample about one allocation per rate bytes for the heap profile
+ * from now on, or stop sampling if rate is 0; blocks sampled already stay in
+ * the profile until they are freed. Other threads notice within
+ * PROFILE_RECHECK bytes of their allocations.
  *
- * @param[in] void
- * @return
+ * @param[in] rate
+ * @return false if HEAP_PROFILE is off, rate is too large or the table can
+ * not be mapped
  */
-bool mm_init(void) {
-
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1) {
+bool mm_profile_start(size_t rate) {
+    if (!HEAP_PROFILE || rate > SIZE_MAX / 4) {
         return false;
     }
-    for (int i = 0; i < BUCKET_SIZE; i++) {
-        seglist[i] = NULL;
-    }
 
-    start[0] = pack(0, true, true, false); // Heap prologue (block footer)
-    start[1] = pack(0, true, true, false); // Heap epilogue (block header)
-
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-    small_block_start = NULL;
-
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
-        return false;
+    profile_lock();
+    if (profile_table == NULL && rate != 0) {
+        // The table lives outside the heap, where it neither counts towards
+        // the heap nor is found by the heap checker
+        size_t bytes = PROFILE_SLOTS * sizeof(profile_entry_t) +
+                       PROFILE_FILTER * sizeof(uint16_t);
+        void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            profile_unlock();
+            return false;
+        }
+        profile_table = table;
+        profile_filter = (uint16_t *)(profile_table + PROFILE_SLOTS);
     }
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+    profile_unlock();
 
+    // The calling thread starts at its next allocation
+    profile_countdown = 0;
     return true;
 }
 
 /**
- * @brief Allocate memory from heap, splite and coalesce the approiated block
- * and return porinter of the requested block preconidtion: the heap has
- * available memory size postconditon: return the pointer of the block and
- * maintain the seglist
+ * @brief write the live samples to fd in the heap profile format of
+ * gperftools, which pprof reads along with the binary: a line per sample
+ * with its size and backtrace, then the mappings of the process to place
+ * the return addresses. Each sample stands for about profile_rate bytes of
+ * allocations like it.
  *
- * @param[in] size
- * @return pointer of the requested block
+ * @param[in] fd
  */
-void *malloc(size_t size) {
-
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
-
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
+void mm_profile_dump(int fd) {
+    char line[64 + PROFILE_DEPTH * 24];
+
+    profile_lock();
+    int len = snprintf(line, sizeof(line),
+                       "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                       profile_live, profile_live_bytes, profile_live,
+                       profile_live_bytes, profile_rate);
+    profile_write(fd, line, (size_t)len);
+    for (size_t i = 0; profile_table != NULL && i < PROFILE_SLOTS; i++) {
+        const profile_entry_t *entry = &profile_table[i];
+        if (entry->ptr == NULL) {
+            continue;
         }
+        len = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", entry->size,
+                       entry->size);
+        for (size_t f = 0; f < entry->depth; f++) {
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " %p",
+                            entry->frames[f]);
+        }
+        line[len++] = '\n';
+        profile_write(fd, line, (size_t)len);
     }
+    profile_unlock();
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+    const char header[] = "\nMAPPED_LIBRARIES:\n";
+    profile_write(fd, header, sizeof(header) - 1);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps < 0) {
+        return;
     }
-
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-
-    if (asize == min_block_size && small_block_start != NULL) {
-
-        block = small_block_start;
-
-    } else {
-        // Search the free list for a fit
-        block = find_fit(asize);
+    ssize_t n;
+    while ((n = read(maps, line, sizeof(line))) > 0) {
+        profile_write(fd, line, (size_t)n);
     }
+    close(maps);
+}
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
+#ifndef DRIVER
+/**
+ * @brief POSIX aligned allocation, see mm_memalign
+ *
+ * @param[out] memptr receives the payload
+ * @param[in] alignment a power of 2 and a multiple of sizeof(void *)
+ * @param[in] size
+ * @return 0, EINVAL for a bad alignment, ENOMEM if the heap can not grow
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+        alignment % sizeof(void *) != 0) {
+        return EINVAL;
     }
-
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    write_block(block, block_size, true, get_prev_alloc(block),
-                get_prev_small(block));
-
-    if (asize == min_block_size && small_block_start != NULL) {
-        remove_small_list(block);
-    } else {
-        remove_seg_list(block);
-
-        // Try to split the block if too large
+    void *bp = mm_memalign(alignment, size);
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
     }
-    split_block(block, asize);
+    *memptr = bp;
+    return 0;
+}
 
-    bp = header_to_payload(block);
+/**
+ * @brief C11 aligned allocation, see mm_memalign
+ *
+ * @param[in] alignment a power of 2
+ * @param[in] size
+ * @return the payload, NULL on failure
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
 
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+/**
+ * @brief glibc name of mm_malloc_usable_size
+ *
+ * @param[in] bp
+ * @return the usable size of the payload, 0 if bp is NULL
+ */
+size_t malloc_usable_size(void *bp) {
+    return mm_malloc_usable_size(bp);
 }
 
 /**
- * @brief Free the the allocated memory
- * precodition: the block is allocated
- * postcondition: the allocated block is free
+ * @brief C++ sized operator delete(void *, std::size_t), by its mangled
+ * name on LP64, where std::size_t is unsigned long
+ *
  * @param[in] bp
- * @return void
+ * @param[in] size
  */
-void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
+void _ZdlPvm(void *bp, size_t size) {
+    mm_free_sized(bp, size);
+}
 
-    if (bp == NULL) {
-        return;
+/**
+ * @brief C++ sized operator delete[](void *, std::size_t), see _ZdlPvm
+ *
+ * @param[in] bp
+ * @param[in] size
+ */
+void _ZdaPvm(void *bp, size_t size) {
+    mm_free_sized(bp, size);
+}
+#endif /* ndef DRIVER */
+
+/**
+ * @brief resize an allocated block, the body of realloc. The sample of the
+ * block in the heap profile follows it once it has been resized or moved,
+ * with the new size, and stays as it was if that fails.
+ * precondition: ptr is allocated and size is not 0
+ *
+ * @param[in] ptr
+ * @param[in] size
+ * @return the payload of the resized block, NULL if out of memory
+ */
+static void *resize_payload(void *ptr, size_t size) {
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+
+    // A slab object keeps its slot while it fits, and moves otherwise
+    slab_t *run = slab_of(ptr);
+    if (run != NULL) {
+        if (size <= run->size) {
+            profile_move(ptr, ptr, size);
+            return ptr;
+        }
+        newptr = alloc_payload(size);
+        if (newptr != NULL) {
+            memcpy(newptr, ptr, run->size);
+            count_realloc_copy(run->size);
+            profile_move(ptr, newptr, size);
+            free(ptr);
+        }
+        return newptr;
     }
 
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    // A mapped block that stays huge resizes its region without copying;
+    // one that no longer is moves back into the heap
+    if (is_mapped(block)) {
+        if (size > MMAP_THRESHOLD) {
+            return remap_block(block, size);
+        }
+        newptr = alloc_payload(size);
+        if (newptr != NULL) {
+            memcpy(newptr, ptr, size);
+            count_realloc_copy(size);
+            profile_move(ptr, newptr, size);
+            unmap_block(block);
+        }
+        return newptr;
+    }
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    // A block that grows huge moves to a region of its own, as malloc would
+    // have put it, rather than growing the heap for good
+    size_t asize = round_up(size + wsize, dsize);
+    if (MMAP_THRESHOLD != 0 && size > MMAP_THRESHOLD &&
+        asize > get_size(block)) {
+        newptr = map_block(size);
+        if (newptr != NULL) {
+            dbg_ensures(mem_is_mapped(newptr, (char *)newptr + size - 1));
+            copysize = get_payload_size(block);
+            memcpy(newptr, ptr, copysize);
+            count_realloc_copy(copysize);
+            profile_move(ptr, newptr, size);
+            free(ptr);
+        }
+        return newptr;
+    }
 
-    write_block(block, size, false, get_prev_alloc(block),
-                get_prev_small(block));
+    // Shrink in place, or grow into the free space right after the block
+    arena_lock(arena_of(block));
+    dbg_requires(mm_checkheap(__LINE__));
+    bool in_place = true;
+    if (asize <= get_size(block)) {
+        shrink_block(block, asize);
+    } else {
+        in_place = grow_block(block, asize);
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock();
+    if (in_place) {
+        profile_move(ptr, ptr, size);
+        return ptr;
+    }
+
+    // Otherwise the block has to move. A block moved before keeps growing,
+    // so it gets room to grow in place next time: as much again as it needs,
+    // up to realloc_headroom bytes and no bigger than a block malloc keeps
+    // in the heap
+    size_t msize = asize;
+    if (get_realloc_grown(block)) {
+        msize += asize < realloc_headroom ? asize : realloc_headroom;
+        size_t heap_max = round_up(MMAP_THRESHOLD + wsize, dsize);
+        if (MMAP_THRESHOLD != 0 && msize > heap_max) {
+            msize = max(asize, heap_max);
+        }
+    }
+    arena_lock(get_thread_arena());
+    block_t *moved = alloc_block(msize);
+    if (moved != NULL) {
+        set_realloc_grown(moved);
+    }
+    arena_unlock();
+
+    // If malloc fails, the original block is left untouched
+    if (moved == NULL) {
+        return NULL;
+    }
+    newptr = header_to_payload(moved);
 
-    // Mark the block as free
+    // Copy the old data
+    copysize = get_payload_size(block); // gets size of old payload
+    if (size < copysize) {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+    count_realloc_copy(copysize);
 
-    // Try to coalesce the block with its neighbors
-    coalesce_block(block, size);
+    // Free the old block
+    profile_move(ptr, newptr, size);
+    free(ptr);
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    return newptr;
 }
 
 /**
@@ -1471,10 +4819,6 @@ void free(void *bp) {
  * @return
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-
     // If size == 0, then free block and return NULL
     if (size == 0) {
         free(ptr);
@@ -1486,25 +4830,12 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL) {
-        return NULL;
-    }
-
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize) {
-        copysize = size;
+    // A resize due for a sample records the block anew, in place of the
+    // sample it had
+    if (profile_due(size)) {
+        return profile_record(resize_payload(ptr, size), size);
     }
-    memcpy(newptr, ptr, copysize);
-
-    // Free the old block
-    free(ptr);
-
-    return newptr;
+    return resize_payload(ptr, size);
 }
 
 /**
@@ -1520,27 +4851,225 @@ void *realloc(void *ptr, size_t size) {
  */
 void *calloc(size_t elements, size_t size) {
     void *bp;
-    size_t asize = elements * size;
+    size_t bytes = elements * size;
 
     if (elements == 0) {
         return NULL;
     }
-    if (asize / elements != size) {
+    if (bytes / elements != size) {
         // Multiplication overflowed
         return NULL;
     }
 
-    bp = malloc(asize);
-    if (bp == NULL) {
+    // Small blocks are cheaper to clear than to reason about
+    if (bytes <= TCACHE_MAX_SIZE - wsize) {
+        bp = malloc(bytes);
+        if (bp != NULL) {
+            memset(bp, 0, bytes);
+        }
+        return bp;
+    }
+
+    // A fresh region reads as zero
+    if (MMAP_THRESHOLD != 0 && bytes > MMAP_THRESHOLD) {
+        bp = malloc(bytes);
+        if (!FRESH_HEAP_ZERO && bp != NULL) {
+            memset(bp, 0, bytes);
+        }
+        return bp;
+    }
+
+    // The requests above count for the heap profile in malloc
+    if (profile_due(bytes)) {
+        return profile_record(calloc(elements, size), bytes);
+    }
+
+    if (!heap_ready()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return NULL;
+    }
+
+    arena_lock(get_thread_arena());
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t asize = round_up(bytes + wsize, dsize);
+    block_t *block = take_block(asize);
+    size_t dirty = 0;
+    word_t *footer = NULL;
+    if (block != NULL) {
+        dirty = dirty_prefix(block);
+        footer = header_to_footer(block);
+        place_block(block, asize);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock();
+    if (block == NULL) {
         return NULL;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Only what may have been written since mem_sbrk needs clearing
+    bp = header_to_payload(block);
+    memset(bp, 0, dirty < bytes ? dirty : bytes);
+    if (dirty < bytes && (char *)footer < (char *)bp + bytes) {
+        memset(footer, 0, wsize);
+    }
 
     return bp;
 }
 
+/**
+ * @brief allocate n blocks of size bytes each at once, as n calls of malloc
+ * would, but holding the arena lock once and carving as many blocks as fit
+ * out of each free block found, instead of searching the free lists for
+ * every one of them
+ *
+ * @param[in] size
+ * @param[in] n
+ * @param[out] out the n payloads
+ * @return the number of blocks allocated, fewer than n only if the heap can
+ * not grow; out holds them at its start
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    size_t count = 0;
+
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+
+    // A batch due for the heap profile has its first block sampled for the
+    // bytes of the whole batch, as calloc's sample stands for every element
+    if (profile_due(n > SIZE_MAX / size ? SIZE_MAX : n * size)) {
+        count = mm_malloc_batch(size, n, out);
+        profile_record(count > 0 ? out[0] : NULL, count * size);
+        return count;
+    }
+
+    if (!heap_ready()) {
+        dbg_printf("Problem initializing heap. Likely due to sbrk");
+        return 0;
+    }
+
+    // Huge requests get a region each, there is nothing to share
+    if (MMAP_THRESHOLD != 0 && size > MMAP_THRESHOLD) {
+        while (count < n && (out[count] = map_block(size)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+
+    arena_lock(get_thread_arena());
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Small requests come from slab runs, where malloc would serve them
+    size_t ssize = round_up(size, dsize);
+    if (size <= SLAB_MAX_SIZE && ssize < round_up(size + wsize, dsize)) {
+        while (count < n && (out[count] = slab_alloc(ssize)) != NULL) {
+            count++;
+        }
+    }
+
+    size_t asize = round_up(size + wsize, dsize);
+    block_t *block;
+    while (count < n && (block = quick_get(asize)) != NULL) {
+        out[count++] = header_to_payload(block);
+    }
+
+    // One free block for the whole rest if there is one; otherwise one
+    // block at a time, which grows the heap by a whole step once nothing
+    // fits, and the next blocks are carved from that
+    while (count < n) {
+        size_t left = n - count;
+        block = NULL;
+        if (left > 1 && left <= cur_arena->heap_bytes / asize) {
+            block = find_fit(left * asize);
+        }
+        if (block == NULL) {
+            block = take_block(asize);
+        }
+        if (block == NULL) {
+            break;
+        }
+        count += carve_block(block, asize, left, out + count);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    arena_unlock();
+    return count;
+}
+
+/**
+ * @brief free n blocks at once, as n calls of free would; the blocks are
+ * sorted by address, and neighbouring blocks are merged into one free block
+ * before it is coalesced, so a run of them costs one free list update
+ * instead of one per block
+ *
+ * @param[in,out] ptrs the payloads, reordered on return; NULL entries are
+ * skipped
+ * @param[in] n
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    sort_addresses(ptrs, n);
+
+    arena_t *locked = NULL;
+    size_t i = 0;
+    while (i < n) {
+        void *bp = ptrs[i++];
+        if (bp == NULL) {
+            continue;
+        }
+        profile_forget(bp);
+
+        slab_t *run = slab_of(bp);
+        block_t *block = payload_to_header(bp);
+        if (run == NULL && is_mapped(block)) {
+            unmap_block(block);
+            continue;
+        }
+
+        arena_t *owner = run != NULL ? run->arena : arena_of(block);
+        if (owner != locked) {
+            if (locked != NULL) {
+                dbg_ensures(mm_checkheap(__LINE__));
+                arena_unlock();
+            }
+            arena_lock(owner);
+            locked = owner;
+            dbg_requires(mm_checkheap(__LINE__));
+        }
+
+        if (run != NULL) {
+            slab_free(run, bp);
+            continue;
+        }
+
+        // Take in the blocks right after this one; a run of them never
+        // crosses an epilogue, as no payload starts right behind one
+        size_t size = get_size(block);
+        size_t first = i;
+        while (i < n && ptrs[i] == (char *)block + size + wsize) {
+            profile_forget(ptrs[i]);
+            size += get_size(payload_to_header(ptrs[i]));
+            i++;
+        }
+
+        // A batch is not parked on the quick lists even when coalescing is
+        // deferred; it is freed in bulk already
+        if (i == first) {
+            free_block(block);
+        } else {
+            write_block(block, size, false, get_prev_alloc(block),
+                        get_prev_small(block));
+            trim_heap(coalesce_block(block, size));
+        }
+    }
+
+    if (locked != NULL) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        arena_unlock();
+    }
+}
+
 /*
  *****************************************************************************
  * Do not delete the following super-secret(tm) lines!                       *
@@ -59,6 +59,48 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate `size` bytes at an address that is a multiple of
+ *         `alignment`, as POSIX specifies.
+ *
+ * @param[out] memptr  Receives a pointer to the allocated bytes.
+ * @param[in] alignment  A power of two and a multiple of `sizeof(void *)`.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, `EINVAL` or `ENOMEM` otherwise.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate `size` bytes at an address that is a multiple of
+ *         `alignment`, as C11 specifies.
+ *
+ * @param[in] alignment  A power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the allocated bytes, NULL on failure.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  The number of bytes usable at `ptr`, as glibc names it.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  At least the size `ptr` was allocated with, 0 if `ptr` is NULL.
+ */
+extern size_t malloc_usable_size(void *ptr);
+
+/**
+ * @brief  C++ sized `operator delete` and `operator delete[]`, under their
+ *         mangled names, which pass the object size on to mm_free_sized.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size of the object.
+ */
+extern void _ZdlPvm(void *ptr, size_t size);
+extern void _ZdaPvm(void *ptr, size_t size);
 #endif
 
 /**
@@ -68,6 +110,156 @@ extern void *calloc(size_t nmemb, size_t size);
  */
 extern bool mm_init(void);
 
+/**
+ * @brief  Whether the allocator was built thread-safe (MM_THREAD_SAFE).
+ *
+ * @return  True if several threads may call it at once, False otherwise.
+ */
+extern bool mm_thread_safe(void);
+
+/**
+ * @brief  Choose whether mm_free defers coalescing, from the next mm_init on.
+ *
+ * @param[in] defer  True to park freed blocks uncoalesced until needed.
+ *
+ * @return  The previous choice.
+ */
+extern bool mm_defer_coalescing(bool defer);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each in one call.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks.
+ * @param[out] out  Receives a pointer to each block.
+ *
+ * @return  The number of blocks allocated, fewer than `n` if out of memory.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Free `n` allocated blocks in one call.
+ *
+ * @param[in,out] ptrs  The blocks to free; reordered on return.
+ * @param[in] n  The number of blocks.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  Free an allocated block whose size the caller knows.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size the block was allocated or last resized with.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes at an address
+ *         that is a multiple of `alignment`.
+ *
+ * @param[in] alignment  A power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the allocated bytes, NULL on failure.
+ */
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  The number of bytes the caller may use at `ptr`, which can be more
+ *         than it asked for; writing up to that many never needs a realloc.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  At least the size `ptr` was allocated with, 0 if `ptr` is NULL.
+ */
+extern size_t mm_malloc_usable_size(void *ptr);
+
+/** @brief  Most seglist buckets struct mm_stats has room for. */
+#define MM_STATS_BUCKETS 64
+
+/**
+ * @brief  Counters of the allocator, filled in by mm_stats. Byte counts are
+ *         of whole blocks, headers included; the other counts are totals
+ *         since mm_init. The search depth of a bucket is the mean over the
+ *         arenas that have searched it: search_limit, where every bucket
+ *         starts, if it was never tuned, and 0 if searches have no limit.
+ */
+struct mm_stats {
+    size_t heap_bytes;      /* bytes of heap got from sbrk and still held */
+    size_t mapped_bytes;    /* bytes of the regions of mapped blocks */
+    size_t in_use_bytes;    /* bytes allocated, mapped regions included */
+    size_t mini_free_bytes; /* bytes of the free 16 byte blocks */
+    size_t deferred_bytes;  /* bytes freed but waiting to be coalesced */
+    size_t slab_free_bytes; /* bytes of the free objects of slab runs */
+    size_t buckets;         /* seglist buckets described below */
+    size_t bucket_min_size[MM_STATS_BUCKETS];     /* smallest block of each */
+    size_t bucket_free_bytes[MM_STATS_BUCKETS];   /* free bytes in each */
+    size_t bucket_search_depth[MM_STATS_BUCKETS]; /* search depth, see above */
+    size_t search_limit;       /* depth of an untuned bucket, 0 if none */
+    size_t sbrks;              /* times the heap was extended */
+    size_t fit_searches;       /* searches of the seglist for a fit */
+    size_t fit_probes;         /* free blocks those searches looked at */
+    size_t splits;             /* blocks split to the size asked for */
+    size_t coalesces;          /* free neighbours merged into freed blocks */
+    size_t realloc_copies;     /* reallocs that moved their block */
+    size_t realloc_copy_bytes; /* bytes those reallocs copied */
+    size_t profile_samples;    /* blocks sampled for the heap profile */
+    size_t profile_live;       /* sampled blocks not freed yet */
+    size_t profile_live_bytes; /* bytes those blocks asked for */
+};
+
+/**
+ * @brief  Read the counters of the allocator, without walking the heap.
+ *
+ * @param[out] stats  Receives the counters.
+ */
+extern void mm_stats(struct mm_stats *stats);
+
+/**
+ * @brief  Where the free bytes of the heap lie, filled in by mm_heap_frag.
+ *         Byte counts are of whole blocks, headers included.
+ */
+struct mm_frag {
+    size_t heap_bytes;       /* bytes of heap got from sbrk and still held */
+    size_t mapped_bytes;     /* bytes of the regions of mapped blocks */
+    size_t in_use_bytes;     /* bytes allocated, mapped regions included */
+    size_t free_bytes;       /* bytes of the free blocks, mini blocks too */
+    size_t deferred_bytes;   /* bytes freed but waiting to be coalesced */
+    size_t slab_free_bytes;  /* bytes of the free objects of slab runs */
+    size_t largest_free;     /* bytes of the largest free block */
+    size_t mini_free_blocks; /* free 16 byte blocks */
+    size_t buckets;          /* seglist buckets described below */
+    size_t bucket_min_size[MM_STATS_BUCKETS];    /* smallest block of each */
+    size_t bucket_free_blocks[MM_STATS_BUCKETS]; /* free blocks in each */
+    size_t bucket_free_bytes[MM_STATS_BUCKETS];  /* free bytes in each */
+};
+
+/**
+ * @brief  Walk the heap to find where its free bytes lie. Slow, and stops
+ *         every other thread while it runs.
+ *
+ * @param[out] frag  Receives the free blocks by bucket.
+ */
+extern void mm_heap_frag(struct mm_frag *frag);
+
+/**
+ * @brief  Sample about one allocation per `rate` bytes for the heap profile,
+ *         recording its size and backtrace until it is freed.
+ *
+ * @param[in] rate  Mean bytes between samples, 0 to stop sampling.
+ *
+ * @return  True on success, False if profiling is not built in.
+ */
+extern bool mm_profile_start(size_t rate);
+
+/**
+ * @brief  Write the sampled blocks that are still allocated as a heap
+ *         profile pprof reads.
+ *
+ * @param[in] fd  The file descriptor to write to.
+ */
+extern void mm_profile_dump(int fd);
+
 /* This is for debugging.  Returns false if error encountered */
 /**
  * @brief  Check the heap for inconsistencies.
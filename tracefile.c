@@ -245,6 +245,46 @@ static void read_alloc_line(traceop_t *op, traceopcode_t opcode, char *args,
     op->index = (unsigned int)read_single_number(idtext, UINT_MAX, fname,
                                                  lineno, "block ID");
     op->size = read_single_number(args, SIZE_MAX, fname, lineno, "block size");
+    op->align = 0;
+}
+
+/** Read an 'm' trace line (specifying a call to memalign).  The text
+ *  at ARGS should match /[ \t]*[0-9]+[ \t]*[0-9]+[ \t]*[0-9]+/; the
+ *  numbers are the block ID, the size to allocate and the alignment,
+ *  which must be a power of two.
+ *
+ *  @param op      traceop_t object to be initialized.
+ *  @param args    Arguments for this trace line, as text.
+ *  @param fname   Trace file name (for error reporting).
+ *  @param lineno  Trace line number (for error reporting).
+ */
+static void read_memalign_line(traceop_t *op, char *args, const char *fname,
+                               unsigned int lineno) {
+    // Split off the alignment, the line has no trailing white space
+    char *aligntext = args + strlen(args);
+    while (aligntext > args && aligntext[-1] != ' ' && aligntext[-1] != '\t') {
+        aligntext--;
+    }
+    if (aligntext == args) {
+        app_error("%s:%u: error: invalid trace: "
+                  "while reading alignment, found a not-number",
+                  fname, lineno);
+    }
+    size_t align =
+        read_single_number(aligntext, SIZE_MAX, fname, lineno, "alignment");
+    if (align == 0 || (align & (align - 1)) != 0) {
+        app_error("%s:%u: error: invalid trace: "
+                  "alignment is not a power of two",
+                  fname, lineno);
+    }
+    char *end = aligntext;
+    while (end > args && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    *end = '\0';
+
+    read_alloc_line(op, MEMALIGN, args, fname, lineno);
+    op->align = align;
 }
 
 /** Read a 'f' trace line (specifying a call to free).
@@ -267,6 +307,7 @@ static void read_free_line(traceop_t *op, char *args, const char *fname,
     op->index = (unsigned int)read_single_number(args, UINT_MAX, fname, lineno,
                                                  "block ID");
     op->size = 0;
+    op->align = 0;
 }
 
 /** Read a trace file into a freshly allocated trace_t object.
@@ -365,6 +406,9 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
             trace->ops[op].type = REALLOC;
             read_alloc_line(&trace->ops[op], REALLOC, line + 1, fname, lineno);
             break;
+        case 'm':
+            read_memalign_line(&trace->ops[op], line + 1, fname, lineno);
+            break;
         case 'f':
             trace->ops[op].type = FREE;
             read_free_line(&trace->ops[op], line + 1, fname, lineno);
@@ -26,9 +26,10 @@ typedef enum weight_t {
  *  by this trace operation.
  */
 typedef enum traceopcode_t {
-    ALLOC,   /* 'a': call malloc */
-    FREE,    /* 'f': call free */
-    REALLOC, /* 'r': call realloc */
+    ALLOC,    /* 'a': call malloc */
+    FREE,     /* 'f': call free */
+    REALLOC,  /* 'r': call realloc */
+    MEMALIGN, /* 'm': call memalign */
 } traceopcode_t;
 
 /** Description of a single trace operation (allocator request).  */
@@ -37,6 +38,7 @@ typedef struct traceop_t {
     unsigned int lineno : 24; /* line number in trace file */
     unsigned int index;       /* block id, to use in realloc/free */
     size_t size;              /* byte size of alloc/realloc request */
+    size_t align;             /* alignment of memalign request, else 0 */
 } traceop_t;
 
 /** Data structure corresponding to a complete trace file.  */